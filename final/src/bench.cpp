@@ -0,0 +1,251 @@
+// Headless benchmark for the SPH solver. Runs SPHFluid::update without SDL or
+// OpenGL and reports the time spent in each phase of the solver.
+//
+// Usage: final_bench [particles] [steps] [cloth[=<n>]] [substeps=<n>]
+//                    [skin=<verlet skin>] [reorder=<interval>]
+//                    [adaptive[=<courant>]] [budget=<ms>]
+//                    [hashed] [incremental] [sleep] [serial] [scalar]
+//                    [threads=<n>] [save=<checkpoint>] [load=<checkpoint>]
+//                    [record=<trajectory>] [compact] [heat=<0|1>]
+//
+// Exits with 1 if any particle position or velocity ends up non-finite.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "sound.h"
+#include "sph_fluid.h"
+#include "sph_kernels.h"
+#include "spring_system.h"
+#include "trajectory.h"
+
+// Normally owned by the audio callback in main.cpp
+std::vector<bubbleSound> bubbles;
+
+// Fluid with a configurable number of substeps
+class BenchFluid : public SPHFluid {
+ public:
+  BenchFluid(int particles, int substeps, SpringSystem *ss, bool heat)
+      : SPHFluid(ss, heat, particles) {
+    SetSubsteps(substeps);
+  }
+
+  void SetSubsteps(int substeps) { simSteps = std::max(substeps, 1); }
+};
+
+int main(int argc, char *argv[]) {
+  int particles = argc > 1 ? atoi(argv[1]) : 1000;
+  int steps = argc > 2 ? atoi(argv[2]) : 1000;
+  bool cloth = false;
+  int clothW = 21, clothH = 10;
+  int substeps = 1;
+  float skin = 0;
+  int reorder = -1;
+  bool serial = false;
+  bool hashed = false;
+  bool incremental = false;
+  bool sleep = false;
+  bool compact = false;
+  bool heat = true;
+  float courant = 0;
+  float budget = 0;
+  const char *save = nullptr;
+  const char *load = nullptr;
+  const char *record = nullptr;
+  for (int i = 3; i < argc; i++) {
+    if (!strncmp(argv[i], "cloth", 5)) cloth = true;
+    if (!strncmp(argv[i], "cloth=", 6)) clothW = clothH = atoi(argv[i] + 6);
+    if (!strncmp(argv[i], "substeps=", 9)) substeps = atoi(argv[i] + 9);
+    if (!strncmp(argv[i], "skin=", 5)) skin = atof(argv[i] + 5);
+    if (!strncmp(argv[i], "reorder=", 8)) reorder = atoi(argv[i] + 8);
+    if (!strncmp(argv[i], "hashed", 6)) hashed = true;
+    if (!strncmp(argv[i], "incremental", 11)) incremental = true;
+    if (!strncmp(argv[i], "adaptive", 8)) courant = 0.4;
+    if (!strncmp(argv[i], "adaptive=", 9)) courant = atof(argv[i] + 9);
+    if (!strncmp(argv[i], "budget=", 7)) budget = atof(argv[i] + 7);
+    if (!strncmp(argv[i], "sleep", 5)) sleep = true;
+    if (!strncmp(argv[i], "compact", 7)) compact = true;
+    if (!strncmp(argv[i], "heat=", 5)) heat = atoi(argv[i] + 5) != 0;
+    if (!strncmp(argv[i], "serial", 6)) serial = true;
+    if (!strncmp(argv[i], "scalar", 6)) sphForceScalarKernels(true);
+    if (!strncmp(argv[i], "save=", 5)) save = argv[i] + 5;
+    if (!strncmp(argv[i], "load=", 5)) load = argv[i] + 5;
+    if (!strncmp(argv[i], "record=", 7)) record = argv[i] + 7;
+#ifdef _OPENMP
+    if (!strncmp(argv[i], "threads=", 8)) {
+      omp_set_num_threads(atoi(argv[i] + 8));
+    }
+#endif
+  }
+  float delta = 1 / 240.;
+
+  srand(0);
+
+  SpringSystem *ss = cloth ? new SpringSystem(clothW, clothH) : nullptr;
+  BenchFluid *fluid = new BenchFluid(particles, substeps, ss, heat);
+
+  // Start from a checkpoint instead of spawning particles. The options below
+  // override what it was saved with.
+  if (load) {
+    auto t0 = std::chrono::steady_clock::now();
+    if (!fluid->loadCheckpoint(load)) return 1;
+    printf("loaded %s in %.2f ms\n", load,
+           std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - t0)
+               .count());
+    particles = fluid->NumParticles();
+  }
+  fluid->SetSubsteps(substeps);
+  fluid->SetNeighborSkin(skin);
+  fluid->SetHashedGrid(hashed);
+  fluid->SetIncrementalGrid(incremental);
+  fluid->SetSleeping(sleep);
+  fluid->SetCompactVBO(compact);
+  fluid->SetAdaptiveSteps(courant, 64, budget);
+  if (reorder >= 0) fluid->SetReorderInterval(reorder);
+  fluid->SetParallelRelaxation(!serial);
+  fluid->SetParallelViscosity(!serial);
+
+  // Spawn particles until the fluid is full, these steps are not measured
+  int warmup = 0;
+  while (fluid->NumParticles() < particles && warmup < 100000) {
+    fluid->update(delta);
+    bubbles.clear();
+    warmup++;
+  }
+  particles = fluid->NumParticles();
+  fluid->Stats().reset();
+
+  if (save) {
+    auto t0 = std::chrono::steady_clock::now();
+    if (!fluid->saveCheckpoint(save)) return 1;
+    printf("saved %s in %.2f ms\n", save,
+           std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - t0)
+               .count());
+  }
+
+  // Record every measured step, the recording counts towards the total
+  TrajectoryWriter recorder;
+  if (record && !recorder.open(record)) return 1;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++) {
+    fluid->update(delta);
+    bubbles.clear();
+    if (record) recorder.record((i + 1) * delta, fluid, ss);
+  }
+  double total = std::chrono::duration<double, std::nano>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  SolverStats &stats = fluid->Stats();
+  double perParticleStep = 1. / std::max(1L, stats.particleSteps);
+  printf("particles: %d, steps: %ld, warmup steps: %d, cloth: %s\n",
+         particles, stats.steps, warmup, cloth ? "yes" : "no");
+  if (cloth) {
+    printf("cloth: %dx%d, collision tests: %ld (%.2f per particle step)\n",
+           clothW, clothH, stats.clothTests,
+           stats.clothTests * perParticleStep);
+  }
+  printf("kernels: %s, grid: %s, heat: %s\n", sphKernelName(),
+         hashed ? "hashed" : "dense", heat ? "yes" : "no");
+  printf("substeps: %.2f per update (max %d), dt: %g s avg, simulated %.3f "
+         "of %.3f s, %ld slowed updates\n",
+         stats.steps / std::max(1., (double)stats.frames), stats.maxSubsteps,
+         stats.simTime / std::max(1L, stats.steps), stats.simTime,
+         steps * delta, stats.slowFrames);
+  printf("neighbor skin: %g, list rebuilds: %ld (%.2f per substep)\n",
+         skin, stats.neighborBuilds,
+         stats.neighborBuilds / std::max(1., (double)stats.steps));
+  printf("grid builds: %ld, incremental updates: %ld (%.1f moved each)\n",
+         stats.gridBuilds, stats.gridUpdates,
+         stats.gridMoved / std::max(1., (double)stats.gridUpdates));
+  printf("sleeping: %s (%.1f%% of particle steps)\n", sleep ? "yes" : "no",
+         100. * stats.sleepingSteps * perParticleStep);
+  if (record) {
+    // Read the last frame back to check how far it is from the fluid
+    recorder.close();
+    TrajectoryReader reader;
+    TrajectoryState last;
+    float error = -1;
+    if (reader.open(record) &&
+        reader.readFrame(reader.NumFrames() - 1, &last)) {
+      error = 0;
+      for (int id = 0; id < (int)last.pos.size(); id++) {
+        glm::vec3 p = fluid->Position(fluid->ParticleIndex(id));
+        error = std::max(error, glm::length(last.pos[id] - p));
+      }
+    }
+    printf("recorded: %ld frames, %ld dropped, %.1f bytes/particle/frame, "
+           "last frame error %g\n",
+           recorder.Frames(), recorder.Dropped(),
+           recorder.Bytes() / std::max(1., (double)recorder.Frames()) /
+               std::max(particles, 1),
+           error);
+  }
+  if (compact) {
+    // Largest distance between a particle and its packed vertex
+    glm::vec3 lo, hi;
+    fluid->PackedBounds(&lo, &hi);
+    const PackedVertex *v = fluid->PackedVboData();
+    float error = 0;
+    for (int i = 0; i < particles; i++) {
+      glm::vec3 p = fluid->Position(i);
+      glm::vec3 q = glm::vec3(v[i].x, v[i].y, v[i].z) / 65535.f;
+      error = std::max(error, glm::length(lo + q * (hi - lo) - p));
+    }
+    printf("compact vertices: %d bytes/particle, position error %g\n",
+           (int)sizeof(PackedVertex), error);
+  }
+  printf("\n");
+  printf("%-24s %12s %16s %8s\n", "phase", "total (ms)", "ns/particle/step",
+         "share");
+  double other = total;
+  for (int p = 0; p < NUM_PHASES; p++) {
+    other -= stats.ns[p];
+    printf("%-24s %12.3f %16.2f %7.1f%%\n", phaseName(p), stats.ns[p] / 1e6,
+           stats.ns[p] * perParticleStep, 100 * stats.ns[p] / total);
+  }
+  printf("%-24s %12.3f %16.2f %7.1f%%\n", "other", other / 1e6,
+         other * perParticleStep, 100 * other / total);
+  printf("%-24s %12.3f %16.2f %7.1f%%\n", "total", total / 1e6,
+         total * perParticleStep, 100.);
+
+  // Hash of the final positions, to check runs are reproducible
+  unsigned hash = 2166136261u;
+  for (int i = 0; i < particles; i++) {
+    glm::vec3 p = fluid->Position(fluid->ParticleIndex(i));
+    const unsigned char *bytes = (const unsigned char *)&p;
+    for (unsigned b = 0; b < sizeof(p); b++) {
+      hash = (hash ^ bytes[b]) * 16777619u;
+    }
+  }
+  printf("\nposition hash: %08x\n", hash);
+
+  // A blown up simulation still hashes, so check for it separately
+  int nonFinite = 0;
+  for (int i = 0; i < particles; i++) {
+    glm::vec3 p = fluid->Position(i), v = fluid->Velocity(i);
+    if (glm::any(glm::isnan(p)) || glm::any(glm::isinf(p)) ||
+        glm::any(glm::isnan(v)) || glm::any(glm::isinf(v))) {
+      nonFinite++;
+    }
+  }
+  if (nonFinite > 0) {
+    printf("%d of %d particles have non-finite positions or velocities\n",
+           nonFinite, particles);
+  }
+
+  delete fluid;
+  delete ss;
+  return nonFinite > 0 ? 1 : 0;
+}
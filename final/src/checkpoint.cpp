@@ -0,0 +1,169 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char MAGIC[8] = "SPHCKPT";
+
+uint64_t alignUp(uint64_t n, uint64_t a) { return (n + a - 1) / a * a; }
+
+}  // namespace
+
+const uint32_t CheckpointWriter::PAGE_SIZE;
+
+CheckpointWriter::CheckpointWriter(uint32_t version) : version(version) {}
+
+void CheckpointWriter::add(uint32_t tag, const void *p, size_t bytes) {
+  CheckpointSection s;
+  s.tag = tag;
+  s.reserved = 0;
+  s.offset = 0;
+  s.bytes = bytes;
+  sections.push_back(s);
+  data.push_back(p);
+}
+
+bool CheckpointWriter::write(const char *path) {
+  CheckpointHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = version;
+  header.pageSize = PAGE_SIZE;
+  header.numSections = (uint32_t)sections.size();
+  header.reserved = 0;
+
+  // Lay the sections out one page boundary after another
+  uint64_t offset = sizeof(header) + sections.size() * sizeof(sections[0]);
+  for (size_t i = 0; i < sections.size(); i++) {
+    offset = alignUp(offset, PAGE_SIZE);
+    sections[i].offset = offset;
+    offset += sections[i].bytes;
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Can't write checkpoint %s\n", path);
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  if (!sections.empty()) {
+    ok = ok && fwrite(sections.data(), sizeof(sections[0]), sections.size(),
+                      f) == sections.size();
+  }
+  static const char zeros[PAGE_SIZE] = {0};
+  uint64_t at = sizeof(header) + sections.size() * sizeof(sections[0]);
+  for (size_t i = 0; i < sections.size() && ok; i++) {
+    size_t pad = (size_t)(sections[i].offset - at);
+    ok = fwrite(zeros, 1, pad, f) == pad;
+    ok = ok && fwrite(data[i], 1, (size_t)sections[i].bytes, f) ==
+                   sections[i].bytes;
+    at = sections[i].offset + sections[i].bytes;
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok) fprintf(stderr, "Error writing checkpoint %s\n", path);
+  return ok;
+}
+
+CheckpointReader::CheckpointReader()
+    : base(nullptr), size(0), header(nullptr), table(nullptr) {
+#ifdef _WIN32
+  file = mapping = nullptr;
+#endif
+}
+
+CheckpointReader::~CheckpointReader() { close(); }
+
+bool CheckpointReader::open(const char *path) {
+  close();
+
+#ifdef _WIN32
+  HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER fileSize;
+  if (f == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Can't open checkpoint %s\n", path);
+    return false;
+  }
+  file = f;
+  if (!GetFileSizeEx(f, &fileSize) || fileSize.QuadPart == 0) {
+    fprintf(stderr, "Can't map checkpoint %s\n", path);
+    close();
+    return false;
+  }
+  mapping = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping) {
+    base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  size = (size_t)fileSize.QuadPart;
+#else
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open checkpoint %s\n", path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = (size_t)st.st_size;
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) base = (const char *)p;
+  }
+  // The mapping stays valid without the descriptor
+  ::close(fd);
+#endif
+  if (!base) {
+    fprintf(stderr, "Can't map checkpoint %s\n", path);
+    close();
+    return false;
+  }
+
+  // Check the header and that every section lies inside the file
+  header = (const CheckpointHeader *)base;
+  table = (const CheckpointSection *)(header + 1);
+  bool ok = size >= sizeof(*header) &&
+            std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+            size - sizeof(*header) >=
+                (uint64_t)header->numSections * sizeof(*table);
+  for (uint32_t i = 0; ok && i < header->numSections; i++) {
+    ok = table[i].offset <= size && table[i].bytes <= size - table[i].offset;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s is not a valid checkpoint\n", path);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CheckpointReader::close() {
+#ifdef _WIN32
+  if (base) UnmapViewOfFile(base);
+  if (mapping) CloseHandle(mapping);
+  if (file) CloseHandle(file);
+  file = mapping = nullptr;
+#else
+  if (base) munmap((void *)base, size);
+#endif
+  base = nullptr;
+  size = 0;
+  header = nullptr;
+  table = nullptr;
+}
+
+const void *CheckpointReader::section(uint32_t tag, size_t *bytes) const {
+  for (uint32_t i = 0; header && i < header->numSections; i++) {
+    if (table[i].tag == tag) {
+      *bytes = (size_t)table[i].bytes;
+      return base + table[i].offset;
+    }
+  }
+  return nullptr;
+}
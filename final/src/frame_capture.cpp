@@ -0,0 +1,265 @@
+#include "frame_capture.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Full range BT.601, as y4m's C420jpeg expects
+inline uint8_t lumaOf(int r, int g, int b) {
+  return (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+// Offset by 128 * 256 so the sums stay positive before the shift
+inline uint8_t chromaOf(int c) {
+  return (uint8_t)std::min(255, (c + 128 * 256 + 128) >> 8);
+}
+
+}  // namespace
+
+FrameCapture::FrameCapture(int lag, int encoders)
+    : lag(std::max(1, lag)),
+      numEncoders(std::max(1, encoders)),
+      width(0),
+      height(0),
+      dir(nullptr),
+      format(PPM),
+      stream(nullptr),
+      frames(0),
+      buffers(0),
+      nextFrame(0),
+      closing(false),
+      failed(0) {}
+
+FrameCapture::~FrameCapture() {
+  // Without the GL context the frames still in flight are lost, but the
+  // encoders must not outlive the object
+  if (!encoders.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closing = true;
+    }
+    ready.notify_all();
+    for (size_t i = 0; i < encoders.size(); i++) encoders[i].join();
+  }
+  if (stream) fclose(stream);
+}
+
+bool FrameCapture::open(int w, int h, const char *imageDir, Format fmt,
+                        const char *y4m, int fps) {
+  width = w;
+  height = h;
+  dir = imageDir;
+  format = fmt;
+  if (y4m) {
+    stream = fopen(y4m, "wb");
+    if (!stream) {
+      fprintf(stderr, "Can't write video stream %s\n", y4m);
+      return false;
+    }
+    fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width,
+            height, fps);
+  }
+
+  // Frames are read back as RGBA, the format read backs are fastest in
+  pbo.resize(lag + 1);
+  fence.assign(lag + 1, nullptr);
+  glGenBuffers((GLsizei)pbo.size(), pbo.data());
+  for (size_t i = 0; i < pbo.size(); i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, 4 * width * height, nullptr,
+                 GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  for (int i = 0; i < numEncoders; i++) {
+    encoders.push_back(std::thread(&FrameCapture::run, this));
+  }
+  return true;
+}
+
+void FrameCapture::capture() {
+  if (pbo.empty()) return;
+
+  int s = (int)(frames % pbo.size());
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[s]);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadBuffer(GL_BACK);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  fence[s] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  frames++;
+
+  // Frees the slot the next frame is read into
+  if (frames > lag) readBack(frames - 1 - lag);
+}
+
+void FrameCapture::readBack(long k) {
+  int s = (int)(k % pbo.size());
+  size_t bytes = 4 * (size_t)width * height;
+
+  // Take a buffer for the frame, waiting for the encoders if they have all
+  // of them
+  std::vector<uint8_t> rgba;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    int most = 2 * numEncoders + 1;
+    done.wait(lock, [&] { return !spare.empty() || buffers < most; });
+    if (!spare.empty()) {
+      rgba.swap(spare.back());
+      spare.pop_back();
+    } else {
+      buffers++;
+    }
+  }
+  rgba.resize(bytes);
+
+  // Only waits if the read back hasn't finished yet
+  GLenum status = GL_TIMEOUT_EXPIRED;
+  while (status == GL_TIMEOUT_EXPIRED) {
+    status = glClientWaitSync(fence[s], GL_SYNC_FLUSH_COMMANDS_BIT,
+                              1000000000);
+  }
+  glDeleteSync(fence[s]);
+  fence[s] = nullptr;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[s]);
+  const void *p =
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+  if (p) {
+    std::memcpy(rgba.data(), p, bytes);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    fprintf(stderr, "Failed to map frame %ld\n", k);
+    std::fill(rgba.begin(), rgba.end(), 0);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Job job;
+    job.index = k;
+    job.rgba.swap(rgba);
+    queue.push_back(std::move(job));
+  }
+  ready.notify_one();
+}
+
+void FrameCapture::close() {
+  if (pbo.empty()) return;
+
+  for (long k = std::max(0L, frames - lag); k < frames; k++) readBack(k);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+  }
+  ready.notify_all();
+  for (size_t i = 0; i < encoders.size(); i++) encoders[i].join();
+  encoders.clear();
+
+  glDeleteBuffers((GLsizei)pbo.size(), pbo.data());
+  pbo.clear();
+  fence.clear();
+  if (stream && fclose(stream) != 0) {
+    fprintf(stderr, "Error writing video stream\n");
+  }
+  stream = nullptr;
+}
+
+void FrameCapture::run() {
+  std::vector<uint8_t> image, yuv;
+  int w = width, h = height;
+  int cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [this] { return closing || !queue.empty(); });
+      if (queue.empty()) return;
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+    const uint8_t *rgba = job.rgba.data();
+    bool ok = true;
+
+    // Image, rows flipped to top-down and alpha dropped
+    if (dir) {
+      char header[32] = "";
+      if (format == PPM) sprintf(header, "P6\n%d %d\n255\n", w, h);
+      size_t hb = strlen(header);
+      image.resize(hb + 3 * (size_t)w * h);
+      std::memcpy(image.data(), header, hb);
+      uint8_t *out = image.data() + hb;
+      for (int y = 0; y < h; y++) {
+        const uint8_t *row = rgba + 4 * (size_t)w * (h - 1 - y);
+        for (int x = 0; x < w; x++, out += 3) {
+          out[0] = row[4 * x + 0];
+          out[1] = row[4 * x + 1];
+          out[2] = row[4 * x + 2];
+        }
+      }
+      ok = writeImage(job.index, image);
+    }
+
+    // y4m frame, 4:2:0 with chroma averaged over 2x2 blocks
+    if (stream) {
+      static const char tag[] = "FRAME\n";
+      size_t tb = sizeof(tag) - 1;
+      yuv.resize(tb + (size_t)w * h + 2 * (size_t)cw * ch);
+      std::memcpy(yuv.data(), tag, tb);
+      uint8_t *Y = yuv.data() + tb;
+      uint8_t *U = Y + (size_t)w * h;
+      uint8_t *V = U + (size_t)cw * ch;
+      for (int y = 0; y < h; y++) {
+        const uint8_t *row = rgba + 4 * (size_t)w * (h - 1 - y);
+        for (int x = 0; x < w; x++) {
+          Y[(size_t)w * y + x] = lumaOf(row[4 * x], row[4 * x + 1],
+                                        row[4 * x + 2]);
+        }
+      }
+      for (int cy = 0; cy < ch; cy++) {
+        int y0 = 2 * cy, y1 = std::min(y0 + 1, h - 1);
+        const uint8_t *r0 = rgba + 4 * (size_t)w * (h - 1 - y0);
+        const uint8_t *r1 = rgba + 4 * (size_t)w * (h - 1 - y1);
+        for (int cx = 0; cx < cw; cx++) {
+          int x0 = 4 * (2 * cx), x1 = 4 * std::min(2 * cx + 1, w - 1);
+          int r = r0[x0] + r0[x1] + r1[x0] + r1[x1];
+          int g = r0[x0 + 1] + r0[x1 + 1] + r1[x0 + 1] + r1[x1 + 1];
+          int b = r0[x0 + 2] + r0[x1 + 2] + r1[x0 + 2] + r1[x1 + 2];
+          U[(size_t)cw * cy + cx] = chromaOf((-43 * r - 85 * g + 128 * b) / 4);
+          V[(size_t)cw * cy + cx] = chromaOf((128 * r - 107 * g - 21 * b) / 4);
+        }
+      }
+
+      // Frames go into the stream in order
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&] { return nextFrame == job.index; });
+      if (fwrite(yuv.data(), 1, yuv.size(), stream) != yuv.size()) ok = false;
+      nextFrame++;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      spare.push_back(std::vector<uint8_t>());
+      spare.back().swap(job.rgba);
+      if (!ok) failed++;
+    }
+    done.notify_all();
+  }
+}
+
+bool FrameCapture::writeImage(long k, const std::vector<uint8_t> &block) {
+  char fname[512];
+  snprintf(fname, sizeof(fname), "%s/image_%04ld.%s", dir, k,
+           format == PPM ? "ppm" : "rgb");
+  FILE *f = fopen(fname, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to open %s to write image\n", fname);
+    return false;
+  }
+  bool ok = fwrite(block.data(), 1, block.size(), f) == block.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok) fprintf(stderr, "Error writing image %s\n", fname);
+  return ok;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Binary checkpoint files. A checkpoint is a header and a table of tagged
+// sections, followed by the sections themselves, each starting on a page
+// boundary. Readers map the file into memory, so opening one costs next to
+// nothing and each section can be copied out in one go or used in place.
+// Files are written in the byte order of the machine.
+//
+// Layout:
+//   CheckpointHeader
+//   CheckpointSection[numSections]
+//   padding to PAGE_SIZE, section 0, padding to PAGE_SIZE, section 1, ...
+struct CheckpointHeader {
+  char magic[8];  // "SPHCKPT" and a terminating 0
+  uint32_t version;  // Version of the contents, chosen by the writer
+  uint32_t pageSize;
+  uint32_t numSections;
+  uint32_t reserved;
+};
+
+struct CheckpointSection {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t offset;  // From the start of the file, a multiple of pageSize
+  uint64_t bytes;
+};
+
+// Collects sections and writes them out on close(). The data of each section
+// has to stay valid until then.
+class CheckpointWriter {
+ public:
+  static const uint32_t PAGE_SIZE = 4096;
+
+  explicit CheckpointWriter(uint32_t version);
+
+  void add(uint32_t tag, const void *data, size_t bytes);
+
+  // Write the checkpoint to path, false if it couldn't be written
+  bool write(const char *path);
+
+ private:
+  uint32_t version;
+  std::vector<CheckpointSection> sections;
+  std::vector<const void *> data;
+};
+
+// Read-only memory mapping of a checkpoint file
+class CheckpointReader {
+ public:
+  CheckpointReader();
+  ~CheckpointReader();
+
+  // Map the checkpoint at path and check its header, false if it can't be
+  // opened or isn't a checkpoint
+  bool open(const char *path);
+  void close();
+
+  uint32_t Version() const { return header->version; }
+
+  // Start of the section with the given tag and its size in *bytes, or null
+  // if there is no such section
+  const void *section(uint32_t tag, size_t *bytes) const;
+
+  // Copy a section of exactly n elements of T into out, false if the section
+  // is missing or has a different size
+  template <typename T>
+  bool read(uint32_t tag, T *out, size_t n) const;
+
+ private:
+  const char *base;
+  size_t size;
+  const CheckpointHeader *header;
+  const CheckpointSection *table;
+#ifdef _WIN32
+  void *file, *mapping;
+#endif
+
+  CheckpointReader(const CheckpointReader &);
+  CheckpointReader &operator=(const CheckpointReader &);
+};
+
+template <typename T>
+bool CheckpointReader::read(uint32_t tag, T *out, size_t n) const {
+  size_t bytes;
+  const void *p = section(tag, &bytes);
+  if (!p || bytes != n * sizeof(T)) return false;
+  if (bytes) std::memcpy((void *)out, p, bytes);
+  return true;
+}
+
+// Tag made of four characters, e.g. checkpointTag("POS ")
+inline uint32_t checkpointTag(const char *s) {
+  return (uint32_t)(unsigned char)s[0] | (uint32_t)(unsigned char)s[1] << 8 |
+         (uint32_t)(unsigned char)s[2] << 16 |
+         (uint32_t)(unsigned char)s[3] << 24;
+}
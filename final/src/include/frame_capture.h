@@ -0,0 +1,81 @@
+#pragma once
+
+#include "glad/glad.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Captures rendered frames to numbered images and/or a y4m video stream
+// without stalling the render loop on the read back.
+//
+// capture() starts an asynchronous glReadPixels of the back buffer into one
+// of a ring of pixel pack buffers and fences it. The frame is mapped and
+// copied out lag frames later, when the GPU (or Mesa's software rasterizer,
+// which simply finishes the copy inside glReadPixels) is long done with it.
+// A pool of encoder threads then flips and converts the frames and writes
+// each one with a single block write. Images are written in parallel; frames
+// of the y4m stream are written in order. When the encoders fall behind the
+// render loop waits for them rather than dropping frames.
+class FrameCapture {
+ public:
+  enum Format { PPM, RAW };  // RAW is bare top-down RGB bytes
+
+  explicit FrameCapture(int lag = 2, int encoders = 2);
+  ~FrameCapture();
+
+  // Start capturing width x height frames. Images go to dir as
+  // image_0000.ppm (or .rgb) and so on, unless dir is null; the y4m stream
+  // goes to y4m at fps frames per second, unless it is null. False if the
+  // stream can't be created.
+  bool open(int width, int height, const char *dir, Format format,
+            const char *y4m = nullptr, int fps = 60);
+
+  // Start reading back the frame just drawn, call before swapping buffers
+  void capture();
+
+  // Read back and write out the frames still in flight, needs the GL context
+  void close();
+
+  long Frames() const { return frames; }  // Frames captured
+  long Failed() const { return failed; }  // Frames that couldn't be written
+
+ private:
+  struct Job {
+    long index;
+    std::vector<uint8_t> rgba;  // Bottom-up rows, as read back
+  };
+
+  int lag, numEncoders;
+  int width, height;
+  const char *dir;
+  Format format;
+  FILE *stream;  // y4m, or null
+
+  // Pixel pack buffer ring, frame k is read into slot k % (lag + 1)
+  std::vector<GLuint> pbo;
+  std::vector<GLsync> fence;
+  long frames;
+
+  // Frames waiting for an encoder and buffers to reuse for them
+  std::deque<Job> queue;
+  std::vector<std::vector<uint8_t>> spare;
+  int buffers;    // Allocated, queued or spare or being encoded
+  long nextFrame;  // Next frame to go into the y4m stream
+  bool closing;
+  long failed;
+  std::mutex mutex;
+  std::condition_variable ready, done;
+  std::vector<std::thread> encoders;
+
+  void readBack(long k);
+  void run();
+  bool writeImage(long k, const std::vector<uint8_t> &block);
+
+  FrameCapture(const FrameCapture &);
+  FrameCapture &operator=(const FrameCapture &);
+};
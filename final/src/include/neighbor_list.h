@@ -0,0 +1,71 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <vector>
+
+#include "spatial_grid.h"
+
+// Pairs of particles closer than some radius. Each unordered pair is stored
+// once, with the distance and unit direction between the particles at build
+// time, so phases that run before particles move don't have to recompute
+// them. The neighbors of every particle are also kept as compressed sparse
+// rows: the neighbors of particle i are entries k with Begin(i) <= k < End(i).
+class NeighborList {
+ public:
+  NeighborList();
+
+  // Find all pairs of the first n positions closer than radius, using grid
+  // built from the same positions
+  void build(const SpatialGrid &grid, const glm::vec3 *pos, int n,
+             float radius);
+
+  // Same as build, checking every pair
+  void buildBruteForce(const glm::vec3 *pos, int n, float radius);
+
+  // Unordered pairs, |pos[i] - pos[j]|, and (pos[i] - pos[j]) / dist or zero
+  // if the particles are closer than SPH_MIN_DIST
+  int NumPairs() const { return (int)pairI.size(); }
+  int PairI(int p) const { return pairI[p]; }
+  int PairJ(int p) const { return pairJ[p]; }
+  float PairDist(int p) const { return pairDist[p]; }
+  const glm::vec3 &PairDir(int p) const { return pairDir[p]; }
+  const int *PairIs() const { return pairI.data(); }
+  const int *PairJs() const { return pairJ.data(); }
+  const float *PairDists() const { return pairDist.data(); }
+  const glm::vec3 *PairDirs() const { return pairDir.data(); }
+
+  // Pairs found from grid cell c by build, which are all of the pairs that
+  // SpatialGrid::forEachPairInCell(c) visits. Empty after buildBruteForce.
+  bool HasCells() const { return !cellPairs.empty(); }
+  int CellPairsBegin(int c) const { return cellPairs[c]; }
+  int CellPairsEnd(int c) const { return cellPairs[c + 1]; }
+
+  // Per-particle rows, each pair appears in the rows of both particles
+  int Begin(int i) const { return offsets[i]; }
+  int End(int i) const { return offsets[i + 1]; }
+  int Neighbor(int k) const { return j[k]; }
+  const int *Neighbors(int i) const { return j.data() + offsets[i]; }
+  int NumEntries() const { return (int)j.size(); }
+
+  int NumParticles() const { return numParticles; }
+
+  // Mark the list as out of date, e.g. after particles were reordered
+  void invalidate() { numParticles = -1; }
+
+ private:
+  int numParticles;
+
+  std::vector<int> pairI, pairJ;
+  std::vector<float> pairDist;
+  std::vector<glm::vec3> pairDir;
+  std::vector<int> cellPairs;  // First pair of each cell
+
+  std::vector<int> offsets;
+  std::vector<int> j;
+  std::vector<int> fill;  // Scratch write cursor for each row
+
+  void begin(int n);
+  void addPair(int a, int b, const glm::vec3 *pos, float radius);
+  void makeRows();
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+// Per-particle arrays of an SPHFluid, one array per attribute. Arrays are
+// cache line aligned and grow together; growing moves them, so pointers into
+// the old arrays are invalidated.
+class ParticleStorage {
+ public:
+  static const int ALIGNMENT = 64;
+
+  explicit ParticleStorage(int capacity = 0);
+  ~ParticleStorage();
+
+  int Capacity() const { return capacity; }
+
+  // Make room for at least n particles, keeping the first used ones
+  void reserve(int n, int used);
+
+  // Make room for at least n particles, at least doubling the capacity when
+  // it has to grow so repeated calls are amortized O(1)
+  void grow(int n, int used);
+
+  // Reorder the first n particles so that slot k holds the particle that was
+  // in slot perm[k]. Ids move with their particles and slot is updated.
+  void permute(const int *perm, int n);
+
+  glm::vec3 *pos;   // 3D particle position
+  glm::vec3 *ppos;  // Buffer of previous positions to derive velocity
+  glm::vec3 *vel;   // 3D particle velocity
+  glm::vec3 *col;
+  float *heat;  // temperature of particles
+
+  // Stable external ids, unaffected by permute. id maps slots to ids and slot
+  // maps ids back to slots.
+  int *id;
+  int *slot;
+
+ private:
+  int capacity;
+
+  ParticleStorage(const ParticleStorage &);
+  ParticleStorage &operator=(const ParticleStorage &);
+};
@@ -13,5 +13,6 @@ class SampleFluidDemo : public SPHFluid {
 
  private:
   glm::vec3 initialParticlePosition(int i);
+  void initialParticleBounds(glm::vec3 *lo, glm::vec3 *hi);
   glm::vec3 initialParticleVelocity(int i);
 };
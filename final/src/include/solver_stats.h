@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+
+// Phases of SPHFluid::update that are timed separately
+enum SolverPhase {
+  PHASE_GRID,
+  PHASE_VISCOSITY,
+  PHASE_SPRINGS,
+  PHASE_RELAXATION,
+  PHASE_COLLISIONS,
+  PHASE_CLOTH,
+  PHASE_HEAT,
+  PHASE_REORDER,
+  PHASE_VBO,
+  NUM_PHASES,
+  PHASE_NONE = -1
+};
+
+inline const char *phaseName(int phase) {
+  static const char *names[NUM_PHASES] = {"makeGrid",
+                                          "applyViscosity",
+                                          "updateSprings",
+                                          "doubleDensityRelaxation",
+                                          "resolveCollisions",
+                                          "clothInteraction",
+                                          "transferHeat",
+                                          "reorderParticles",
+                                          "updateVBO"};
+  return names[phase];
+}
+
+// Accumulated solver timings, reset with reset()
+struct SolverStats {
+  double ns[NUM_PHASES];  // Exclusive time spent in each phase
+  long steps;             // Number of simulation substeps taken
+  long particleSteps;     // Sum of particle counts over all substeps
+  long neighborBuilds;    // Substeps that rebuilt the neighbor lists
+  long gridBuilds;        // Full grid builds
+  long gridUpdates;       // Incremental grid updates
+  long gridMoved;         // Particles moved between cells by those updates
+  long clothTests;        // Particle-triangle collision tests
+  long sleepingSteps;     // Sum of sleeping particle counts over all substeps
+  long frames;            // Calls to SPHFluid::update
+  long slowFrames;        // Updates that advanced less than asked to
+  int maxSubsteps;        // Most substeps taken by one update
+  double simTime;         // Simulated seconds
+  int active;             // Phase currently being timed
+
+  SolverStats() { reset(); }
+
+  void reset() {
+    for (int i = 0; i < NUM_PHASES; i++) ns[i] = 0;
+    steps = 0;
+    particleSteps = 0;
+    neighborBuilds = 0;
+    gridBuilds = 0;
+    gridUpdates = 0;
+    gridMoved = 0;
+    clothTests = 0;
+    sleepingSteps = 0;
+    frames = 0;
+    slowFrames = 0;
+    maxSubsteps = 0;
+    simTime = 0;
+    active = PHASE_NONE;
+  }
+};
+
+// Adds the lifetime of the timer to a phase. Timers can nest, in which case
+// the inner phase's time is taken out of the outer one.
+class PhaseTimer {
+ public:
+  PhaseTimer(SolverStats *stats, SolverPhase phase)
+      : stats(stats),
+        phase(phase),
+        parent(stats->active),
+        start(std::chrono::steady_clock::now()) {
+    stats->active = phase;
+  }
+
+  ~PhaseTimer() {
+    double elapsed = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    stats->ns[phase] += elapsed;
+    if (parent != PHASE_NONE) stats->ns[parent] -= elapsed;
+    stats->active = parent;
+  }
+
+ private:
+  SolverStats *stats;
+  SolverPhase phase;
+  int parent;
+  std::chrono::steady_clock::time_point start;
+};
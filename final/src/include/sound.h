@@ -1,8 +1,5 @@
 #pragma once
 
-#include <SDL.h>
-#include <SDL_opengl.h>
-
 #include "glm/glm.hpp"
 
 #include <algorithm>
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Uniform grid over a fixed region used to accelerate neighbor-finding.
+// Particles are bucketed by cell with a counting sort, so a build is
+// O(particles + cells) and doesn't allocate once the buffers have grown to
+// fit. Particles outside the region are clamped into the border cells.
+//
+// A hashed grid has no region instead: cells are hashed from their integer
+// coordinates into a fixed table of buckets, and a bucket may hold particles
+// of several cells. Everything below that takes a cell id then takes a bucket
+// id, and pairs are still only formed between particles of adjacent cells.
+//
+// The particles in cell c are particle(k) for cellStart(c) <= k < cellEnd(c).
+// The grid keeps a copy of the positions it was built from, so consumers can
+// tell how far particles have moved since.
+class SpatialGrid {
+ public:
+  SpatialGrid();
+
+  // Cover the region starting at origin with size cells of width cellSize
+  void init(glm::vec3 origin, glm::ivec3 size, float cellSize);
+
+  // Cover all of space with cells of width cellSize, hashed into at least
+  // numBuckets buckets
+  void initHashed(float cellSize, int numBuckets);
+
+  bool Hashed() const { return hashed; }
+
+  // Bucket the first n positions by cell and snapshot them
+  void build(const glm::vec3 *pos, int n);
+
+  // Leave room in every cell on build, so that update can move particles
+  // between cells without rebuilding
+  void setIncremental(bool inc) { incremental = inc; }
+
+  // Same as build, but only moves the particles that changed cells since the
+  // last build or update when the grid is incremental. Falls back to build if
+  // the particle count changed, more than a maxMoved fraction of particles
+  // changed cells, or a cell ran out of room. Returns false if it rebuilt.
+  bool update(const glm::vec3 *pos, int n, float maxMoved);
+
+  // Particles that changed cells in the last update, 0 after a build
+  int NumMoved() const { return numMoved; }
+
+  // Force the next update to rebuild, e.g. after particles were reordered
+  void invalidate() { valid = false; }
+
+  glm::ivec3 gridPos(const glm::vec3 &p) const {
+    return glm::ivec3(glm::floor((p - origin) * invCellSize));
+  }
+
+  glm::ivec3 clampGridPos(const glm::ivec3 &g) const {
+    return glm::clamp(g, glm::ivec3(0), size - 1);
+  }
+
+  int cellId(const glm::ivec3 &g) const {
+    if (hashed) return bucketId(g);
+    glm::ivec3 c = clampGridPos(g);
+    return (c.z * size.y + c.y) * size.x + c.x;
+  }
+
+  int cellId(const glm::vec3 &p) const { return cellId(gridPos(p)); }
+
+  // Position of p's cell along a Z-order curve through the grid
+  unsigned mortonCode(const glm::vec3 &p) const;
+
+  int cellStart(int cell) const { return start[cell]; }
+  int cellEnd(int cell) const { return end[cell]; }
+  int particle(int k) const { return sorted[k]; }
+
+  // Call f(i, j) once for every unordered pair of particles in the same or
+  // adjacent cells. Each cell is paired with itself and the 13 neighboring
+  // cells that come after it, so no pair of cells is visited twice.
+  template <typename F>
+  void forEachPair(F f) const;
+
+  // The pairs forEachPair visits for one cell. They only involve particles
+  // in the cell and the cells next to it.
+  template <typename F>
+  void forEachPairInCell(int c, F f) const;
+
+  // Cells split into 27 colors by their coordinates mod 3. Cells of the same
+  // color are at least 3 apart along some axis, so the pairs of two such
+  // cells never share a particle and can be processed concurrently. Hashed
+  // grids only put cells of one color in each bucket, so the same holds for
+  // buckets.
+  static const int NUM_COLORS = 27;
+  const std::vector<int> &ColorCells(int color) const {
+    return colorCells[color];
+  }
+
+  // Number of particles and their positions at the last build
+  int NumParticles() const { return numParticles; }
+  const glm::vec3 &SnapshotPosition(int i) const { return snapshot[i]; }
+
+  glm::ivec3 Size() const { return size; }  // Not meaningful when hashed
+  int NumCells() const { return numCells; }
+
+ private:
+  // Forward half of the 26 surrounding cells
+  static const int SHELL[13][3];
+
+  bool hashed;
+  unsigned groupMask;  // Buckets are NUM_COLORS * (groupMask + 1)
+  glm::vec3 origin;
+  glm::ivec3 size;
+  float cellSize, invCellSize;
+  int numCells;
+  int numParticles;
+
+  bool incremental;
+  bool valid;    // Built from the current particle indices
+  int numMoved;
+
+  // Cell c has room for particles in sorted[start[c], start[c + 1])
+  std::vector<int> start;   // First index into sorted for each cell
+  std::vector<int> end;     // One past the last index into sorted
+  std::vector<int> cell;    // Cell id of each particle
+  std::vector<int> sorted;  // Particle indices ordered by cell
+  std::vector<int> where;   // Index of each particle into sorted
+  std::vector<std::pair<int, int> > moves;  // Scratch for update
+  std::vector<glm::vec3> snapshot;  // Positions the grid was built from
+  std::vector<glm::ivec3> coord;    // Cell of each particle, hashed grids only
+  std::vector<int> colorCells[NUM_COLORS];  // Cell ids of each color
+
+  static int floorDiv3(int x) { return x >= 0 ? x / 3 : (x - 2) / 3; }
+
+  // Cells are grouped into 3x3x3 blocks and a block is hashed to a group of
+  // NUM_COLORS buckets, one for each cell, so a bucket has a single color
+  int bucketId(const glm::ivec3 &g) const {
+    glm::ivec3 block(floorDiv3(g.x), floorDiv3(g.y), floorDiv3(g.z));
+    glm::ivec3 m = g - 3 * block;
+    unsigned h = ((unsigned)block.x * 73856093u) ^
+                 ((unsigned)block.y * 19349663u) ^
+                 ((unsigned)block.z * 83492791u);
+    return (int)(h & groupMask) * NUM_COLORS + (m.z * 9 + m.y * 3 + m.x);
+  }
+
+  template <typename F>
+  void forEachPairInBucket(int c, F f) const;
+};
+
+template <typename F>
+void SpatialGrid::forEachPairInCell(int c, F f) const {
+  if (hashed) {
+    forEachPairInBucket(c, f);
+    return;
+  }
+
+  int s = start[c], e = end[c];
+  if (s == e) return;
+
+  // Pairs within this cell
+  for (int a = s; a < e; a++) {
+    for (int b = a + 1; b < e; b++) {
+      f(sorted[a], sorted[b]);
+    }
+  }
+
+  // Pairs with the forward half of the neighboring cells
+  int x = c % size.x;
+  int y = (c / size.x) % size.y;
+  int z = c / (size.x * size.y);
+  for (int o = 0; o < 13; o++) {
+    int nx = x + SHELL[o][0];
+    int ny = y + SHELL[o][1];
+    int nz = z + SHELL[o][2];
+    if (nx < 0 || nx >= size.x || ny < 0 || ny >= size.y || nz >= size.z) {
+      continue;
+    }
+    int nc = (nz * size.y + ny) * size.x + nx;
+    int ne = end[nc];
+    for (int a = s; a < e; a++) {
+      for (int b = start[nc]; b < ne; b++) {
+        f(sorted[a], sorted[b]);
+      }
+    }
+  }
+}
+
+template <typename F>
+void SpatialGrid::forEachPairInBucket(int c, F f) const {
+  // Other cells may share the bucket, so the stencil is walked per particle
+  // and only particles whose cell matches are paired
+  int s = start[c], e = end[c];
+  for (int a = s; a < e; a++) {
+    int i = sorted[a];
+    const glm::ivec3 &g = coord[i];
+
+    // Pairs within i's cell
+    for (int b = a + 1; b < e; b++) {
+      if (coord[sorted[b]] == g) f(i, sorted[b]);
+    }
+
+    // Pairs with the forward half of the neighboring cells
+    for (int o = 0; o < 13; o++) {
+      glm::ivec3 n = g + glm::ivec3(SHELL[o][0], SHELL[o][1], SHELL[o][2]);
+      int nc = bucketId(n);
+      int ne = end[nc];
+      for (int b = start[nc]; b < ne; b++) {
+        if (coord[sorted[b]] == n) f(i, sorted[b]);
+      }
+    }
+  }
+}
+
+template <typename F>
+void SpatialGrid::forEachPair(F f) const {
+  for (int c = 0; c < numCells; c++) {
+    forEachPairInCell(c, f);
+  }
+}
@@ -5,54 +5,143 @@
 #include <unordered_map>
 #include <vector>
 
+#include "neighbor_list.h"
+#include "particle_storage.h"
+#include "solver_stats.h"
+#include "spatial_grid.h"
+#include "sph_kernels.h"
+#include "spring_table.h"
+#include "triangle_grid.h"
 #include "spring_system.h"
 
 // Return a random number [0, 1]
 inline float rand01() { return rand() / (float)RAND_MAX; }
 
-struct NeighborSet {
-  // Save space for as many neighbors as we expect
-  // We might be able to restrict this a bit if we're clever about resizing it
-  // when it fills up.
-  int n[400];
-  int size;
-  NeighborSet() : size(0) {}
-};
-
 class SPHFluid {
  public:
   static const int BOX_VERTICES;
+  static const unsigned CHECKPOINT_VERSION;
 
-  SPHFluid(SpringSystem *ss = nullptr, bool heat = false);
+  SPHFluid(SpringSystem *ss = nullptr, bool heat = false,
+           int maxParticles = 1000);
   virtual ~SPHFluid();
 
   virtual void update(float dt);
 
   // Getters
   int NumParticles() { return numParticles; }
+  int MaxParticles() { return maxParticles; }
   float *VboData() { return vboData; }
+  const PackedVertex *PackedVboData() { return packedVbo.data(); }
   glm::vec3 Position(int i) { return pos[i]; }
   glm::vec3 Velocity(int i) { return vel[i]; }
+  float Heat(int i) { return heat[i]; }
   glm::vec3 Scale() { return glm::vec3(r, r, r); }
   float Radius() { return r; }
   int vboSize();
 
+  // Write particle vertices packed into 8 bytes to PackedVboData instead of
+  // as 4 floats after the box in VboData, positions as fractions of
+  // PackedBounds
+  void SetCompactVBO(bool c);
+
+  // Bounds of the particles when PackedVboData was last written
+  void PackedBounds(glm::vec3 *lo, glm::vec3 *hi) {
+    *lo = packedLo;
+    *hi = packedHi;
+  }
+
+  // Bounds of the box, its walls and the region particles spawn in
+  void DomainBounds(glm::vec3 *lo, glm::vec3 *hi);
+
+  // Per-phase solver timings accumulated over calls to update()
+  SolverStats &Stats() { return stats; }
+
+  // Enable Verlet neighbor lists with the given skin, or disable them with 0
+  void SetNeighborSkin(float s);
+
+  // Save the particles, springs, spawner, tuning parameters and cloth to a
+  // checkpoint file, or restore them from one. A fluid with a cloth can only
+  // load checkpoints of a cloth of the same size; a fluid without one skips
+  // the cloth. Both print why they failed and return false.
+  bool saveCheckpoint(const char *path);
+  bool loadCheckpoint(const char *path);
+
+  // Change how many particles may be spawned, growing storage if needed
+  void SetMaxParticles(int n);
+
+  // Use the parallel Jacobi relaxation (default) or the serial sweep
+  void SetParallelRelaxation(bool p) { parallelRelaxation = p; }
+
+  // Apply viscosity in parallel over colored grid cells (default) or serially
+  void SetParallelViscosity(bool p) { parallelViscosity = p; }
+
+  // Let grid cells whose particles have come to rest sleep. Sleeping particles
+  // skip viscosity, springs and relaxation but still push on awake neighbors.
+  // With heat on, the heated corners keep the whole tank convecting, so cells
+  // rarely come to rest.
+  void SetSleeping(bool s);
+
+  // Choose the number of substeps of each update from the fastest particle,
+  // so that none moves more than c * h per substep, with the fixed substep
+  // count as the minimum. Past maxSteps substeps, or past what fits in
+  // budgetMs of wall-clock time at the measured cost per substep if
+  // budgetMs > 0, the update advances less than dt instead. c <= 0 goes back
+  // to fixed substeps.
+  void SetAdaptiveSteps(float c, int maxSteps = 64, float budgetMs = 0);
+
+  // Substep length and count of the last update
+  float Timestep() { return dt; }
+  int Substeps() { return lastSteps; }
+
+  // Find neighbors with an unbounded hashed grid instead of a dense grid over
+  // the box and spawn region
+  void SetHashedGrid(bool hashed);
+
+  // Patch the grid for particles that changed cells instead of rebuilding it
+  // every substep, as long as few of them did
+  void SetIncrementalGrid(bool inc);
+
+  // Sort particles along a Z-order curve every k substeps, 0 to disable
+  void SetReorderInterval(int k) { reorderInterval = k; }
+
+  // Sort particles along a Z-order curve so that particles close in space are
+  // close in memory. This moves particles between indices; use ParticleId
+  // and ParticleIndex to follow a particle across reorders.
+  void reorderParticles();
+
+  // Stable id of the particle at index i, and the index of a particle by id
+  int ParticleId(int i) { return particles.id[i]; }
+  int ParticleIndex(int id) { return particles.slot[id]; }
+
  protected:
   float dt;          // Timestep
   int numParticles;  // Current number of particles
   int maxParticles;  // Max number of particles allowed
-  glm::vec3 *pos;    // 3D particle position
-  glm::vec3 *ppos;   // Buffer of previous positions to derive velocity
-  glm::vec3 *vel;    // 3D particle velocity
+
+  // Owns the per-particle arrays. pos, ppos, vel, col and heat point into it
+  // and are rebound by reserveParticles when it grows.
+  ParticleStorage particles;
+  glm::vec3 *pos;   // 3D particle position
+  glm::vec3 *ppos;  // Buffer of previous positions to derive velocity
+  glm::vec3 *vel;   // 3D particle velocity
   glm::vec3 *col;
   float *heat;  // temperature of particles
 
-  // x, y, z position data to send to the VBO
+  // x, y, z position data to send to the VBO, sized to particle capacity
   float *vboData;
 
-  // Parallel vectors of i, j indices and rest lengths to represent springs
-  std::vector<int> sp1, sp2;
-  std::vector<float> spL;
+  // Particle vertices in the compact format, if compactVbo is set
+  bool compactVbo;
+  std::vector<PackedVertex> packedVbo;
+  glm::vec3 packedLo, packedHi;
+
+  // Scratch copy of heat for transferHeat
+  std::vector<float> pheat;
+
+  // Springs between nearby particles and scratch displacements for them
+  SpringTable springs;
+  std::vector<glm::vec3> springDisp;
 
   // Error rate to carry over when creating new particles
   float spawnError;
@@ -61,7 +150,39 @@ class SPHFluid {
   // Number of simulation iterations per rendering iteration
   int simSteps;
 
-  NeighborSet n;  // Placeholder for during simulation, only need one at a time
+  // Substeps between calls to reorderParticles, 0 to disable
+  int reorderInterval;
+
+  // Substeps taken since the fluid was created, unlike stats.steps never
+  // reset, so the reorder cadence doesn't depend on profiling
+  long substepCount;
+
+  // Relax densities with the parallel Jacobi variant
+  bool parallelRelaxation;
+
+  // Apply viscosity impulses one grid cell color at a time in parallel
+  bool parallelViscosity;
+
+  // Grid cells fall asleep after sleepSteps substeps in which no particle in
+  // them or the cells around them moved faster than sleepSpeed or changed
+  // pressure by more than sleepPressure or heat by more than sleepHeat
+  bool sleeping;
+  float sleepSpeed;
+  float sleepPressure;
+  float sleepHeat;
+  int sleepSteps;
+  std::vector<char> asleep;  // Particle is in a sleeping cell
+  std::vector<int> cellQuiet;  // Quiet substeps in a row of each cell
+  std::vector<char> cellBusy;  // Scratch for updateSleeping
+  std::vector<float> lastPressure;  // Pressure of the previous substep
+  std::vector<float> lastHeat;      // Heat of the previous substep
+
+  // Adaptive substepping, see SetAdaptiveSteps
+  float courant;        // Courant number, 0 for fixed substeps
+  int maxSimSteps;      // Most substeps per update
+  float frameBudget;    // Wall-clock milliseconds per update, 0 for none
+  double substepCost;   // Running average of nanoseconds per substep
+  int lastSteps;        // Substeps taken by the last update
 
   // Tuning parameters
 
@@ -71,6 +192,11 @@ class SPHFluid {
   // Radius of each particle
   float r;
 
+  // Verlet skin. Neighbor lists are built with radius h + skin and only
+  // rebuilt once some particle has moved more than skin / 2 from where they
+  // were built.
+  float skin;
+
   // Viscosity (higher is more viscous)
   float sig;  // Linear
   float bet;  // Quadratic
@@ -101,43 +227,89 @@ class SPHFluid {
   // Based off of CUDA implementation given by Simon Green
   // http://developer.download.nvidia.com/assets/cuda/files/particles.pdf
   float gridRes;
-  glm::ivec3 gridSize;
-  glm::vec3 worldOrigin;
-  glm::ivec2 *particleHash;
-  int *cellStart;
-  int maxCellId;
+  SpatialGrid grid;
+  bool hashedGrid;  // Hash cells into a table sized for maxParticles
+
+  // Incremental grids are rebuilt once more than this fraction of particles
+  // changed cells in a substep
+  float gridRebuildFraction;
+
+  // Particles within h + skin of each other, rebuilt with the grid
+  NeighborList neighbors;
+  bool neighborsFresh;  // Cached distances match the current positions
+  std::vector<float> liveDist;  // Scratch distances for doubleDensityRelaxation
+
+  // Scratch pair distances and directions for applyViscosity with stale lists
+  std::vector<float> pairDist;
+  std::vector<glm::vec3> pairDir;
+
+  // Pressures of the last relaxation, which sleeping particles keep, and
+  // scratch near-pressures and displacements for doubleDensityRelaxationJacobi
+  std::vector<float> pressure, pressureNear;
+  std::vector<glm::vec3> disp;
 
   SpringSystem *ss;  // Associated cloth system
+
+  // Vertex indices of the cloth triangles, three per triangle, and a grid of
+  // them rebuilt whenever the cloth moves
+  std::vector<int> clothTris;
+  TriangleGrid clothGrid;
+
+  // Per-triangle terms of the cloth collision test that only change when the
+  // cloth moves, one array per term so the plane test can gather them
+  struct ClothTriangles {
+    std::vector<float> nx, ny, nz, d;  // Unit normal and plane offset
+    std::vector<float> nv1, nn;  // dot(n, v1) and dot(n, n) for edge tests
+    std::vector<glm::vec3> a, b;  // Edges v3 - v1 and v2 - v1
+    std::vector<float> dotaa, dotab, dotbb, invDenom;  // Barycentric setup
+  } clothData;
   bool useHeat;
 
+  SolverStats stats;
+
   // Simulation functions
   void applyViscosity();
+  void applyViscosityPair(int p, float dist, const glm::vec3 &rij);
   void updateSprings();
   void doubleDensityRelaxation();
+  void doubleDensityRelaxationSerial();
+  void doubleDensityRelaxationJacobi();
   virtual void resolveCollisions();
   void clothInteraction();
-  glm::vec3 triangleSphereCollisionPoint(int v1, int v2, int v3, int i);
+  void initClothTriangles();
+  void updateClothTriangles();  // Also rebuilds clothGrid
+  glm::vec3 triangleSphereCollisionPoint(int t, int i);
   void transferHeat();
+  void updateSleeping();
+  int planSubsteps(float delta);  // Also sets dt
 
-  // Get the indices of particles within h of p
-  void getNeighbors(int i, NeighborSet *n, bool pairwise = false);
+  // Reorder the first perm.size() entries of v to match reorderParticles
+  template <typename T>
+  static void permuteVector(std::vector<T> *v, const std::vector<int> &perm);
 
   // Spatial hash grid functions
-  glm::ivec3 getGridPos(glm::vec3 *p);
-  int getCellId(glm::ivec3 *gridPos);
-  void clampGridPos(glm::ivec3 *gridPos);
-  void findCellStart();
-  void makeGrid();
+  void initGrid();
+  void makeGrid();  // Also rebuilds the neighbor lists, if they are stale
+  float maxDisplacement();  // Furthest any particle moved since makeGrid
+
+  // Report neighbor pairs the current lists miss (VALIDATE_GRID builds)
+  void validateGrid(const char *phase);
 
   // Defines the volume in which new particles can be created
   virtual glm::vec3 initialParticlePosition(int i);
 
+  // Bounding box of the positions returned by initialParticlePosition
+  virtual void initialParticleBounds(glm::vec3 *lo, glm::vec3 *hi);
+
   // Defines the volume in which new particles can be created
   virtual glm::vec3 initialParticleVelocity(int i);
 
   // Defines the temperature range at which new particles can be created
   virtual float initialParticleHeat(int i);
 
+  // Make room for at least n particles
+  void reserveParticles(int n);
+
   // Creates a new particle at index i
   void newParticle(int i);
 
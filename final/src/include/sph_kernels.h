@@ -0,0 +1,59 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+
+// Per-neighbor and per-triangle math of SPHFluid. Neighbor coordinates and
+// triangle planes are gathered into registers and evaluated 8 at a time with
+// AVX2 when the CPU supports it, one at a time otherwise. The kernels are
+// picked on first use.
+
+// Particles closer than this have no direction between them. Pairs that
+// close are left out of the displacements and get a zero direction.
+const float SPH_MIN_DIST = 1e-6f;
+
+// Compact particle vertex, 8 bytes. Coordinates are 16-bit fractions of the
+// packing bounds and heat an 8-bit fraction of [0, 1], so OpenGL can read
+// them as normalized unsigned attributes.
+struct PackedVertex {
+  uint16_t x, y, z;
+  uint8_t heat, pad;
+};
+
+// Name of the kernels in use, "avx2" or "scalar"
+const char *sphKernelName();
+
+// Use the scalar kernels even if the CPU supports AVX2
+void sphForceScalarKernels(bool force);
+
+// Store the distances from pi to the n particles pos[nbr[k]] in dist, and sum
+// (1 - q)^2 into *p and (1 - q)^3 into *pn over those with q = dist / h < 1
+void sphDensity(const glm::vec3 &pi, const glm::vec3 *pos, const int *nbr,
+                int n, float h, float *dist, float *p, float *pn);
+
+// Jacobi relaxation displacement of the particle at pi with pressures pres
+// and presn, from the n particles pos[nbr[k]] at the distances sphDensity
+// stored and their pressures, leaving out those closer than SPH_MIN_DIST
+glm::vec3 sphDisplacement(const glm::vec3 &pi, float pres, float presn,
+                          const glm::vec3 *pos, const float *pressure,
+                          const float *pressureNear, const int *nbr,
+                          const float *dist, int n, float h, float dt);
+
+// |pos[i[k]] - pos[j[k]]| and the unit direction between them for n pairs,
+// zero for pairs closer than SPH_MIN_DIST
+void sphPairGeometry(const glm::vec3 *pos, const int *i, const int *j, int n,
+                     float *dist, glm::vec3 *dir);
+
+// Bit k is set unless the sphere of radius r at p lies entirely on one side of
+// the plane of triangle tri[k], for n <= 8 triangles given the unit normals
+// (nx, ny, nz) and plane offsets d of all triangles
+unsigned sphPlaneHits(const glm::vec3 &p, float r, const float *nx,
+                      const float *ny, const float *nz, const float *d,
+                      const int *tri, int n);
+
+// Quantize the n particles at pos with heat to out, positions over the
+// bounds starting at lo as (pos - lo) * scale rounded and clamped to 0-65535
+void sphPackVertices(const glm::vec3 *pos, const float *heat, int n,
+                     const glm::vec3 &lo, const glm::vec3 &scale,
+                     PackedVertex *out);
@@ -1,6 +1,8 @@
 #pragma once
 
+#ifndef HEADLESS
 #include <SDL.h>
+#endif
 
 #include "glm/glm.hpp"
 
@@ -16,10 +18,15 @@ class SpringSystem {
   SpringSystem(int w, int h);
   virtual ~SpringSystem();
 
+#ifndef HEADLESS
   virtual void moveBall(const Uint8 *keyState);
+#endif
 
   void update(float dt);
 
+  int NumNodes() { return numNodes; }
+  glm::vec3 Position(int i) { return pos[i]; }
+
  protected:
   int numNodes, numSprings, simSteps;
   float k, kv, restLen, sphereSpeed;
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+// Viscoelastic springs between pairs of particles. Springs are kept in
+// parallel arrays indexed 0 <= t < Size(), with I(t) < J(t), and an open
+// addressing hash maps each pair to its index, so lookup and insertion are
+// O(1). Removing springs compacts the arrays in one pass, which keeps the
+// order of the remaining springs but changes their indices.
+class SpringTable {
+ public:
+  SpringTable();
+
+  int Size() const { return (int)rest.size(); }
+  int I(int t) const { return si[t]; }
+  int J(int t) const { return sj[t]; }
+  float Rest(int t) const { return rest[t]; }
+  float &Rest(int t) { return rest[t]; }
+  const int *Is() const { return si.data(); }
+  const int *Js() const { return sj.data(); }
+  const float *Rests() const { return rest.data(); }
+
+  // Replace all springs with the n springs i[t], j[t] of rest length rest[t]
+  void assign(const int *i, const int *j, const float *rest, int n);
+
+  // Index of the spring between particles a and b, or -1 if there is none
+  int find(int a, int b) const;
+
+  // Index of the spring between a and b, adding one with rest length L if
+  // there is none
+  int insert(int a, int b, float L);
+
+  // Remove every spring with a rest length above maxRest
+  void removeLongerThan(float maxRest);
+
+  // Move springs along with their particles, particle k becomes rank[k]
+  void renumber(const int *rank);
+
+ private:
+  typedef unsigned long long Key;
+  static const Key EMPTY = ~0ull;
+
+  std::vector<int> si, sj;
+  std::vector<float> rest;
+
+  // Hash table of pair keys and spring indices, a power of two in size and
+  // at most half full
+  std::vector<Key> keys;
+  std::vector<int> index;
+
+  static Key pairKey(int a, int b);
+
+  // Slot holding key, or the empty slot where it would go
+  int slot(Key key) const;
+
+  // Resize the hash table to fit n springs and reinsert all of them
+  void rehash(int n);
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "glad/glad.h"
+
+#include <cstddef>
+#include <vector>
+
+// Vertex buffer for data that changes every frame. Its storage is allocated
+// once and split into regions that frames are written to in turn, so the
+// driver never reallocates it and a frame is written while the GPU may still
+// be drawing the ones before it. A fence per region makes writing wait only
+// if the GPU is more than the other regions behind.
+//
+// With ARB_buffer_storage the buffer stays mapped and writes go straight
+// into it, otherwise they go through glBufferSubData.
+class StreamBuffer {
+ public:
+  explicit StreamBuffer(int regions = 3);
+
+  // Allocate regions of regionBytes in buffer for vertices of stride bytes
+  // and leave buffer bound to GL_ARRAY_BUFFER, to set up attributes with
+  void init(GLuint buffer, size_t regionBytes, size_t stride);
+
+  // Copy a frame of vertex data into the next region, at most regionBytes
+  // of it. Returns the first vertex of the region, to offset draws by.
+  int write(const void *data, size_t bytes);
+
+  // Fence the current region after issuing the draws that read it
+  void fence();
+
+  // Delete the fences and unmap the buffer, needs the GL context
+  void close();
+
+  bool Persistent() const { return mapped != nullptr; }
+
+ private:
+  GLuint buffer;
+  size_t regionBytes, stride;
+  char *mapped;
+  std::vector<GLsync> fences;
+  int region;  // Region last written
+
+  void wait(int k);
+
+  StreamBuffer(const StreamBuffer &);
+  StreamBuffer &operator=(const StreamBuffer &);
+};
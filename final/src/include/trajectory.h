@@ -0,0 +1,184 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class SPHFluid;
+class SpringSystem;
+
+// Recorded particle and cloth trajectories. A trajectory file is a header
+// followed by chunks of frames and an index of the chunks.
+//
+// Particles are stored in order of their stable ids, so a particle keeps its
+// place across SPHFluid::reorderParticles. Positions are quantized to 16 bits
+// per coordinate over the bounds of every position in the chunk, so particles
+// that leave the box are kept where they are. The first frame of each chunk
+// stores them as they are, the others as differences from the frame before,
+// and both as zigzag varints, so slow particles take about a byte per
+// coordinate. Velocities are quantized to 16 bits over the largest component
+// of the frame and heat to 16 bits over its range in the frame.
+//
+// Layout:
+//   TrajectoryHeader
+//   chunks: TrajectoryChunk, then per frame TrajectoryFrame and its data
+//   index: TrajectoryIndexEntry[numChunks], then TrajectoryFooter
+// Files are written in the byte order of the machine.
+struct TrajectoryHeader {
+  char magic[8];  // "SPHTRAJ" and a terminating 0
+  uint32_t version;
+  uint32_t chunkFrames;  // Most frames per chunk
+};
+
+struct TrajectoryChunk {
+  uint32_t firstFrame;
+  uint32_t numFrames;
+  uint64_t bytes;      // Size of the frames that follow
+  float lo[3], hi[3];  // Bounds positions in the chunk are quantized over
+};
+
+// Data of a frame with n particles and m cloth nodes:
+//   position varints of the n particles, then the m cloth nodes
+//   int16_t velocity[3 * n], uint16_t heat[n]
+struct TrajectoryFrame {
+  float time;
+  uint32_t numParticles;
+  uint32_t numCloth;
+  float velScale;  // Velocity of a component of 32767
+  float heatMin, heatMax;
+  uint32_t bytes;  // Size of the data that follows
+};
+
+struct TrajectoryIndexEntry {
+  uint64_t offset;  // Of the TrajectoryChunk
+  uint32_t firstFrame;
+  uint32_t numFrames;
+};
+
+struct TrajectoryFooter {
+  uint64_t indexOffset;
+  uint64_t numChunks;
+  char magic[8];  // "SPHTEND" and a terminating 0
+};
+
+// Streams frames of an SPHFluid, and its cloth if it has one, to a
+// trajectory file. record() copies the frame into a bounded ring of buffers
+// and returns; a writer thread collects the buffered frames into chunks and
+// encodes and writes out each chunk once it is full. When the writer falls
+// behind and the ring is full, frames are dropped instead of stalling the
+// simulation.
+class TrajectoryWriter {
+ public:
+  static const uint32_t VERSION = 2;
+
+  explicit TrajectoryWriter(int ringSize = 8, int chunkFrames = 32);
+  ~TrajectoryWriter();
+
+  // Start a trajectory at path, false if the file can't be created
+  bool open(const char *path);
+
+  // Queue the current state at the given time, false if the frame was
+  // dropped
+  bool record(float time, SPHFluid *fluid, SpringSystem *ss = nullptr);
+
+  // Write out the queued frames and the index and close the file
+  void close();
+
+  long Frames() const { return frames; }    // Frames queued
+  long Dropped() const { return dropped; }  // Frames dropped
+  uint64_t Bytes() const { return bytes; }  // File size, once closed
+
+ private:
+  // Frame copied out of the simulation, particles in id order
+  struct Slot {
+    float time;
+    std::vector<glm::vec3> pos;  // Particle then cloth positions
+    std::vector<glm::vec3> vel;
+    std::vector<float> heat;
+    int numParticles, numCloth;
+  };
+
+  int chunkFrames;
+  FILE *file;
+
+  // Ring of slots, filled by record() and drained by the writer thread.
+  // Slots head <= k < tail (mod ring size) hold queued frames.
+  std::vector<Slot> ring;
+  int head, tail, queued;
+  bool closing;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::thread writer;
+
+  // Writer thread state. Frames of the chunk being collected are swapped out
+  // of the ring into pending.
+  std::vector<Slot> pending;
+  std::vector<uint16_t> q, prevParticles, prevCloth;
+  std::vector<uint8_t> chunk, frame;
+  uint32_t chunkFirst, chunkCount;
+  uint64_t offset;
+  std::vector<TrajectoryIndexEntry> index;
+  long frames, dropped;
+  uint64_t bytes;
+
+  void run();
+  void encode(const Slot &s, const glm::vec3 &lo, const glm::vec3 &scale);
+  void flushChunk();
+
+  TrajectoryWriter(const TrajectoryWriter &);
+  TrajectoryWriter &operator=(const TrajectoryWriter &);
+};
+
+// Decoded frame, particles in id order
+struct TrajectoryState {
+  float time;
+  std::vector<glm::vec3> pos, vel;
+  std::vector<float> heat;
+  std::vector<glm::vec3> cloth;
+};
+
+// Reads frames back from a trajectory file. Seeking to a frame only decodes
+// its chunk up to that frame; reading frames in order decodes each once.
+class TrajectoryReader {
+ public:
+  TrajectoryReader();
+  ~TrajectoryReader();
+
+  // Open a trajectory and load its index, rebuilding it from the chunks if
+  // the writer didn't get to close the file. False if it isn't a trajectory.
+  bool open(const char *path);
+  void close();
+
+  int NumFrames() const { return numFrames; }
+
+  // Decode frame k into *out, false if there is no such frame or it is
+  // corrupt
+  bool readFrame(int k, TrajectoryState *out);
+
+ private:
+  FILE *file;
+  uint64_t size;  // Of the file, which section sizes are checked against
+  TrajectoryHeader header;
+  std::vector<TrajectoryIndexEntry> index;
+  int numFrames;
+
+  // Chunk being decoded, its bounds, and the frame and read position within
+  // it
+  int chunkId;
+  glm::vec3 chunkLo, chunkStep;
+  std::vector<uint8_t> chunk;
+  size_t at;
+  int next;  // Next frame to be decoded, or -1
+  std::vector<uint16_t> prevParticles, prevCloth;
+
+  bool loadChunk(int c);
+  bool decodeNext(TrajectoryState *out);
+
+  TrajectoryReader(const TrajectoryReader &);
+  TrajectoryReader &operator=(const TrajectoryReader &);
+};
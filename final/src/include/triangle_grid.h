@@ -0,0 +1,47 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <vector>
+
+// Uniform grid over a set of triangles, used to find the cloth triangles a
+// particle might collide with. Each triangle is bucketed into every cell its
+// bounding box overlaps, after growing the box by the distance at which
+// SPHFluid::triangleSphereCollisionPoint can still report a collision. A
+// point then only has to be tested against the triangles of its own cell.
+//
+// The triangles in cell c are triangle(k) for cellStart(c) <= k < cellEnd(c),
+// in increasing order.
+class TriangleGrid {
+ public:
+  TriangleGrid();
+
+  // Bucket the n triangles with vertices v[tri[3t]], v[tri[3t + 1]] and
+  // v[tri[3t + 2]] for spheres of radius r, into cells of about cellSize
+  void build(const glm::vec3 *v, const int *tri, int n, float r,
+             float cellSize);
+
+  // Cell containing p, or -1 if p is outside the grid and so outside every
+  // grown triangle box
+  int cellId(const glm::vec3 &p) const;
+
+  int cellStart(int cell) const { return start[cell]; }
+  int cellEnd(int cell) const { return start[cell + 1]; }
+  int triangle(int k) const { return sorted[k]; }
+  const int *triangles(int k) const { return sorted.data() + k; }
+
+  int NumCells() const { return numCells; }
+
+ private:
+  glm::vec3 origin;
+  glm::ivec3 size;
+  float invCellSize;
+  int numCells;
+
+  std::vector<glm::vec3> boxLo, boxHi;  // Grown box of each triangle
+  std::vector<int> start;  // First slot of each cell, numCells + 1 long
+  std::vector<int> fill;   // Scratch write cursor of each cell
+  std::vector<int> sorted;  // Triangle indices ordered by cell
+
+  glm::ivec3 gridPos(const glm::vec3 &p) const;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free handoff of values from one writer thread to one reader thread.
+// The writer fills Back() and publishes it, the reader picks up the newest
+// published value with consume() and reads it through Front(). Each side
+// owns one of three slots and they swap through the third, so neither ever
+// waits for the other; values the reader doesn't get to are overwritten.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() : front(0), back(1), middle(2) {}
+
+  // Writer side
+  T &Back() { return slots[back]; }
+  void publish() {
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader side. Swap in the newest published value, false if nothing was
+  // published since the last call.
+  bool consume() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+  const T &Front() const { return slots[front]; }
+
+ private:
+  // The middle slot index, with FRESH set while it holds a value the reader
+  // hasn't consumed
+  static const int INDEX = 3;
+  static const int FRESH = 4;
+
+  T slots[3];
+  int front, back;
+  std::atomic<int> middle;
+
+  TripleBuffer(const TripleBuffer &);
+  TripleBuffer &operator=(const TripleBuffer &);
+};
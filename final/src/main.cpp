@@ -16,16 +16,24 @@
 #include "tiny_obj_loader.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "camera.h"
 #include "config.h"
+#include "frame_capture.h"
 #include "sound.h"
 #include "sph_fluid.h"
 #include "spring_system.h"
+#include "stream_buffer.h"
+#include "trajectory.h"
+#include "triple_buffer.h"
 
 SPHFluid* fluid;
 SpringSystem* ss = nullptr;
@@ -48,6 +56,7 @@ bool saveOutput = false;
 
 bool audio = false;
 bool heat = true;
+bool compact = false;  // Upload particles as SPHFluid's packed vertices
 
 glm::mat4 view, proj;
 GLint uniView, uniProj;
@@ -57,14 +66,47 @@ GLint uniView2, uniProj2;
 static int particleShader;
 static int lineShader;
 static int phongShader;
-static const int NUM_VAO = 2;
-static const int NUM_VBO = 2;
-GLuint vao[NUM_VAO];
+static const int NUM_VAO = 3;
+static const int NUM_VBO = 3;
+GLuint vao[NUM_VAO];  // Particles, cloth, box
 GLuint vbo[NUM_VAO];
 
+// Particles and cloth are streamed to vbo[0] and vbo[1], the box is static
+StreamBuffer particleStream, clothStream;
+int particleFirst = 0, clothFirst = 0;  // Vertices drawn from
+
 GLuint InitShader(std::string vShaderFileName, std::string fShaderFileName);
 std::vector<tinyobj::real_t> loadModel(const char* filename);
-void Win2PPM(int width, int height);
+
+// What the simulation thread hands the render thread after each update
+struct RenderFrame {
+  std::vector<float> vbo;    // Particles of SPHFluid::VboData
+  std::vector<PackedVertex> packed;  // Or SPHFluid::PackedVboData if compact
+  glm::vec3 boundsLo, boundsSize;    // SPHFluid::PackedBounds of packed
+  std::vector<float> cloth;  // Copy of SpringSystem::vertices
+  int numParticles = 0;
+  float dt = 0;
+  int substeps = 0;
+};
+TripleBuffer<RenderFrame> frames;
+
+// Copy what drawGeometry needs out of the solver
+void snapshot(RenderFrame* f) {
+  f->numParticles = fluid->NumParticles();
+  if (compact) {
+    const PackedVertex* packed = fluid->PackedVboData();
+    f->packed.assign(packed, packed + f->numParticles);
+    glm::vec3 hi;
+    fluid->PackedBounds(&f->boundsLo, &hi);
+    f->boundsSize = hi - f->boundsLo;
+  } else {
+    const float* particles = fluid->VboData() + 4 * SPHFluid::BOX_VERTICES;
+    f->vbo.assign(particles, particles + 4 * f->numParticles);
+  }
+  if (ss) f->cloth.assign(ss->vertices, ss->vertices + ss->numVertices);
+  f->dt = fluid->Timestep();
+  f->substeps = fluid->Substeps();
+}
 
 void CallBack(void* _beeper, Uint8* _stream, int _len) {
   short* stream = (short*)_stream;
@@ -95,15 +137,28 @@ void CallBack(void* _beeper, Uint8* _stream, int _len) {
   return;
 }
 
-void drawGeometry(float dt) {
+// Draw the latest frame, uploading it first if it is new
+void drawGeometry(const RenderFrame& f, bool upload) {
   glm::mat4 model;
   glm::vec3 colVec = glm::vec3();
 
+  // Write new frames into the next region of the stream buffers
+  if (upload) {
+    if (compact) {
+      particleFirst = particleStream.write(
+          f.packed.data(), f.packed.size() * sizeof(PackedVertex));
+    } else {
+      particleFirst =
+          particleStream.write(f.vbo.data(), f.vbo.size() * sizeof(float));
+    }
+    if (ss) {
+      clothFirst =
+          clothStream.write(f.cloth.data(), f.cloth.size() * sizeof(float));
+    }
+  }
+
   // Draw box
-  glBindVertexArray(vao[0]);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-  glBufferData(GL_ARRAY_BUFFER, fluid->vboSize(), fluid->VboData(),
-               GL_STREAM_DRAW);
+  glBindVertexArray(vao[2]);
 
   glUseProgram(lineShader);
 
@@ -126,11 +181,20 @@ void drawGeometry(float dt) {
   glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(model));
   glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));
   glUniformMatrix4fv(uniProj, 1, GL_FALSE, glm::value_ptr(proj));
+  if (compact) {
+    // The packing bounds follow the particles from frame to frame
+    glUniform3fv(glGetUniformLocation(particleShader, "boundsLo"), 1,
+                 glm::value_ptr(f.boundsLo));
+    glUniform3fv(glGetUniformLocation(particleShader, "boundsSize"), 1,
+                 glm::value_ptr(f.boundsSize));
+  }
 
   colVec = glm::vec3(0.05, 0.35, 1);
   glUniform3fv(uniColor, 1, glm::value_ptr(colVec));
 
-  glDrawArrays(GL_POINTS, SPHFluid::BOX_VERTICES, fluid->NumParticles());
+  glBindVertexArray(vao[0]);
+  glDrawArrays(GL_POINTS, particleFirst, f.numParticles);
+  particleStream.fence();
 
   // Draw cloth
   if (ss) {
@@ -147,15 +211,13 @@ void drawGeometry(float dt) {
     glUniform1i(uniTexID, 0);
 
     glBindVertexArray(vao[1]);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, ss->numVertices * sizeof(float), ss->vertices,
-                 GL_STREAM_DRAW);
 
     // glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     for (int i = 0; i < ss->width; i++) {
-      glDrawArrays(GL_TRIANGLE_STRIP, i * 2 * (ss->height + 1),
+      glDrawArrays(GL_TRIANGLE_STRIP, clothFirst + i * 2 * (ss->height + 1),
                    2 * (ss->height + 1));
     }
+    clothStream.fence();
   }
 }
 
@@ -192,12 +254,40 @@ int main(int argc, char* argv[]) {
   cam =
       new Camera(glm::vec3(0, 2, 5), glm::vec3(0, 0.5, 0), glm::vec3(0, 1, 0));
 
-  if (argc == 1) {
-    fluid = new SPHFluid(ss, heat);
-  } else if (argc > 1 && !strncmp(argv[1], "cloth", 5)) {
-    ss = new SpringSystem(21, 10);
-    fluid = new SPHFluid(ss, heat);
+  // Usage: final [cloth] [particles=<max particles>] [adaptive[=<courant>]]
+  //              [budget=<ms>] [load=<checkpoint>] [save=<checkpoint>]
+  //              [record=<trajectory>] [capture[=<dir>]] [raw]
+  //              [y4m=<video>] [compact]
+  int maxParticles = 1000;
+  float courant = 0, budget = 0;
+  const char *load = nullptr, *save = nullptr, *record = nullptr;
+  const char *captureDir = nullptr, *y4m = nullptr;
+  FrameCapture::Format captureFormat = FrameCapture::PPM;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "cloth", 5)) ss = new SpringSystem(21, 10);
+    if (!strncmp(argv[i], "particles=", 10)) maxParticles = atoi(argv[i] + 10);
+    if (!strncmp(argv[i], "adaptive", 8)) courant = 0.4;
+    if (!strncmp(argv[i], "adaptive=", 9)) courant = atof(argv[i] + 9);
+    if (!strncmp(argv[i], "budget=", 7)) budget = atof(argv[i] + 7);
+    if (!strncmp(argv[i], "load=", 5)) load = argv[i] + 5;
+    if (!strncmp(argv[i], "save=", 5)) save = argv[i] + 5;
+    if (!strncmp(argv[i], "record=", 7)) record = argv[i] + 7;
+    if (!strncmp(argv[i], "capture", 7)) captureDir = "out";
+    if (!strncmp(argv[i], "capture=", 8)) captureDir = argv[i] + 8;
+    if (!strncmp(argv[i], "raw", 3)) captureFormat = FrameCapture::RAW;
+    if (!strncmp(argv[i], "y4m=", 4)) y4m = argv[i] + 4;
+    if (!strncmp(argv[i], "compact", 7)) compact = true;
   }
+  saveOutput = captureDir || y4m;
+  fluid = new SPHFluid(ss, heat, maxParticles);
+  if (load && !fluid->loadCheckpoint(load)) return 1;
+  fluid->SetCompactVBO(compact);
+
+  // Stream every frame to a trajectory file
+  TrajectoryWriter recorder;
+  float simTime = 0;
+  if (record && !recorder.open(record)) return 1;
+  fluid->SetAdaptiveSteps(courant, 64, budget);
 
   SDL_Init(SDL_INIT_VIDEO);  // Initialize Graphics (for OpenGL)
 
@@ -267,20 +357,34 @@ int main(int argc, char* argv[]) {
 
   // Allocate memory on the graphics card to store geometry (vertex buffer
   // object)
-  glGenBuffers(NUM_VBO, vbo);             // Create 1 buffer called vbo
-  glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);  // Set the vbo as the active array
-  // buffer (Only one buffer can be
-  // active at a time)
+  glGenBuffers(NUM_VBO, vbo);  // Create the buffers called vbo
 
-  particleShader = InitShader(SHADER_DIR + "/particle_vertex.glsl",
-                              SHADER_DIR + "/particle_fragment.glsl");
+  // Room for a frame of the most particles the fluid can hold. Leaves vbo[0]
+  // as the active array buffer (Only one buffer can be active at a time)
+  size_t vertexSize = compact ? sizeof(PackedVertex) : 4 * sizeof(float);
+  particleStream.init(vbo[0], vertexSize * fluid->MaxParticles(), vertexSize);
+
+  particleShader = InitShader(
+      SHADER_DIR + (compact ? "/particle_compact_vertex.glsl"
+                            : "/particle_vertex.glsl"),
+      SHADER_DIR + "/particle_fragment.glsl");
 
   // Tell OpenGL how to set fragment shader input
   GLint posAttrib = glGetAttribLocation(particleShader, "position");
   GLint heatAttrib = glGetAttribLocation(particleShader, "heat");
-  glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float), 0);
-  glVertexAttribPointer(heatAttrib, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
-                        (void*)(3 * sizeof(float)));
+  if (compact) {
+    // Normalized 16-bit positions and 8-bit heat, see PackedVertex
+    glVertexAttribPointer(posAttrib, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+                          sizeof(PackedVertex), 0);
+    glVertexAttribPointer(heatAttrib, 1, GL_UNSIGNED_BYTE, GL_TRUE,
+                          sizeof(PackedVertex),
+                          (void*)offsetof(PackedVertex, heat));
+  } else {
+    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
+                          0);
+    glVertexAttribPointer(heatAttrib, 1, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
+                          (void*)(3 * sizeof(float)));
+  }
   // Attribute, vals/attrib., type, normalized?, stride, offset
   // Binds to VBO current GL_ARRAY_BUFFER
   glEnableVertexAttribArray(posAttrib);
@@ -293,6 +397,12 @@ int main(int argc, char* argv[]) {
   uniView = glGetUniformLocation(particleShader, "view");
   uniProj = glGetUniformLocation(particleShader, "proj");
 
+  // The box never changes, upload it once
+  glBindVertexArray(vao[2]);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
+  glBufferData(GL_ARRAY_BUFFER, 4 * SPHFluid::BOX_VERTICES * sizeof(float),
+               fluid->VboData(), GL_STATIC_DRAW);
+
   lineShader = InitShader(SHADER_DIR + "/line_vertex.glsl",
                           SHADER_DIR + "/line_fragment.glsl");
 
@@ -307,7 +417,12 @@ int main(int argc, char* argv[]) {
   uniProj1 = glGetUniformLocation(lineShader, "proj");
 
   glBindVertexArray(vao[1]);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+  if (ss) {
+    clothStream.init(vbo[1], ss->numVertices * sizeof(float),
+                     8 * sizeof(float));
+  } else {
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+  }
 
   phongShader = InitShader(SHADER_DIR + "/phong_vertex.glsl",
                            SHADER_DIR + "/phong_fragment.glsl");
@@ -339,17 +454,72 @@ int main(int argc, char* argv[]) {
   glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
   glEnable(0x8861);
 
+  // Write out rendered frames
+  FrameCapture capture;
+  if (saveOutput && !capture.open(screenWidth, screenHeight, captureDir,
+                                  captureFormat, y4m)) {
+    return 1;
+  }
+
+  // The simulation runs on its own thread, paced to real time, and publishes
+  // a snapshot after every update. Rendering draws the newest one, so
+  // neither waits for the other.
+  std::atomic<bool> quit(false);
+  std::atomic<long> simUpdates(0);
+  snapshot(&frames.Back());
+  frames.publish();
+  std::thread simulation([&] {
+    typedef std::chrono::steady_clock Clock;
+    float delta = 1 / 240.;
+    Clock::duration step = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<float>(delta));
+    Clock::time_point due = Clock::now();  // Wall time simTime catches up at
+    while (!quit) {
+      fluid->update(delta);
+      simTime += delta;
+      if (record) recorder.record(simTime, fluid, ss);
+      snapshot(&frames.Back());
+      frames.publish();
+      simUpdates++;
+
+      // Remove bubbles whose audio have already been playing for 1.5 seconds
+      // from the list.
+      SDL_LockAudioDevice(dev);
+      std::vector<bubbleSound>::iterator bub = bubbles.begin();
+      for (int i = 0; bub != bubbles.end(); i++) {
+        // printf("%d: %f\n", i, bub->audioPosition);
+        if (bub->audioPosition > 1.0f) {
+          bub = bubbles.erase(bub);
+        } else {
+          bub++;
+        }
+      }
+      SDL_UnlockAudioDevice(dev);
+
+      // Sleep until an update's worth of wall time has passed. When updates
+      // take longer than that, run behind real time rather than trying to
+      // catch up after a stall.
+      due += step;
+      Clock::time_point now = Clock::now();
+      if (due > now) {
+        std::this_thread::sleep_until(due);
+      } else if (now - due > std::chrono::milliseconds(100)) {
+        due = now;
+      }
+    }
+  });
+
   // For FPS counter
   int frame = 0;
   unsigned t0 = SDL_GetTicks();
   unsigned t1 = t0;
+  long updates0 = 0;
 
   unsigned tLastFrame = t0;
   unsigned timePast = SDL_GetTicks();
 
   // Event Loop (Loop forever processing each event as fast as possible)
   SDL_Event windowEvent;
-  bool quit = false;
   while (!quit) {
     tLastFrame = timePast;
     timePast = SDL_GetTicks();
@@ -377,10 +547,10 @@ int main(int argc, char* argv[]) {
         glm::perspective(cam->fov, screenWidth / (float)screenHeight, frustNear,
                          frustFar);  // FOV, aspect, near, far
 
-    drawGeometry(delta);
-    fluid->update(delta);
+    bool fresh = frames.consume();
+    drawGeometry(frames.Front(), fresh);
 
-    if (saveOutput) Win2PPM(screenWidth, screenHeight);
+    if (saveOutput) capture.capture();
 
     SDL_GL_SwapWindow(window);  // Double buffering
 
@@ -388,27 +558,25 @@ int main(int argc, char* argv[]) {
     frame++;
     t1 = SDL_GetTicks();
     if (t1 - t0 >= 1000) {
-      char buf[100];
-      sprintf(buf, "SPH Fluid | FPS: %.4f", frame / ((t1 - t0) / 1000.f));
+      long updates = simUpdates;
+      char buf[160];
+      sprintf(buf,
+              "SPH Fluid | FPS: %.4f | sim: %.1f updates/s | dt: %.5f x %d",
+              frame / ((t1 - t0) / 1000.f),
+              (updates - updates0) / ((t1 - t0) / 1000.f),
+              frames.Front().dt, frames.Front().substeps);
       SDL_SetWindowTitle(window, buf);
       t0 = t1;
       frame = 0;
+      updates0 = updates;
     }
-
-    // Remove bubbles whose audio have already been playing for 1.5 seconds from
-    // the list.
-    SDL_LockAudioDevice(dev);
-    std::vector<bubbleSound>::iterator bub = bubbles.begin();
-    for (int i = 0; bub != bubbles.end(); i++) {
-      // printf("%d: %f\n", i, bub->audioPosition);
-      if (bub->audioPosition > 1.0f) {
-        bub = bubbles.erase(bub);
-      } else {
-        bub++;
-      }
-    }
-    SDL_UnlockAudioDevice(dev);
   }
+  simulation.join();
+
+  // Save the final state to warm start later runs from
+  if (save) fluid->saveCheckpoint(save);
+  recorder.close();
+  capture.close();
 
   // Clean Up
   delete fluid;
@@ -418,6 +586,8 @@ int main(int argc, char* argv[]) {
   glDeleteProgram(particleShader);
   glDeleteProgram(lineShader);
   glDeleteProgram(phongShader);
+  particleStream.close();
+  clothStream.close();
   glDeleteBuffers(NUM_VBO, vbo);
   glDeleteVertexArrays(NUM_VAO, vao);
 
@@ -617,43 +787,3 @@ std::vector<tinyobj::real_t> loadModel(const char* filename) {
   }
   return model;
 }
-
-// Write out PPM image from screen
-void Win2PPM(int width, int height) {
-  char outdir[] = "out/";  // Must be defined!
-  int i, j;
-  FILE* fptr;
-  static int counter = 0;
-  char fname[32];
-  unsigned char* image;
-
-  /* Allocate our buffer for the image */
-  image = (unsigned char*)malloc(3 * width * height * sizeof(unsigned char));
-  if (image == NULL) {
-    fprintf(stderr, "ERROR: Failed to allocate memory for image\n");
-  }
-
-  /* Open the file */
-  sprintf(fname, "%simage_%04d.ppm", outdir, counter);
-  if ((fptr = fopen(fname, "w")) == NULL) {
-    fprintf(stderr, "ERROR: Failed to open file to write image\n");
-  }
-
-  /* Copy the image into our buffer */
-  glReadBuffer(GL_BACK);
-  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, image);
-
-  /* Write the PPM file */
-  fprintf(fptr, "P6\n%d %d\n255\n", width, height);
-  for (j = height - 1; j >= 0; j--) {
-    for (i = 0; i < width; i++) {
-      fputc(image[3 * j * width + 3 * i + 0], fptr);
-      fputc(image[3 * j * width + 3 * i + 1], fptr);
-      fputc(image[3 * j * width + 3 * i + 2], fptr);
-    }
-  }
-
-  free(image);
-  fclose(fptr);
-  counter++;
-}
@@ -0,0 +1,73 @@
+#include "neighbor_list.h"
+
+#include <algorithm>
+
+#include "sph_kernels.h"
+
+NeighborList::NeighborList() : numParticles(0) {}
+
+void NeighborList::begin(int n) {
+  // clear() keeps the capacity from previous builds
+  numParticles = n;
+  pairI.clear();
+  pairJ.clear();
+  pairDist.clear();
+  pairDir.clear();
+}
+
+void NeighborList::addPair(int a, int b, const glm::vec3 *pos, float radius) {
+  glm::vec3 d = pos[a] - pos[b];
+  float len = glm::length(d);
+  if (len < radius) {
+    pairI.push_back(a);
+    pairJ.push_back(b);
+    pairDist.push_back(len);
+    pairDir.push_back(len > SPH_MIN_DIST ? d / len : glm::vec3(0));
+  }
+}
+
+void NeighborList::makeRows() {
+  // Counting sort of both ends of every pair into per-particle rows
+  int numPairs = NumPairs();
+  offsets.assign(numParticles + 1, 0);
+  for (int p = 0; p < numPairs; p++) {
+    offsets[pairI[p] + 1]++;
+    offsets[pairJ[p] + 1]++;
+  }
+  for (int i = 0; i < numParticles; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  fill.assign(offsets.begin(), offsets.end() - 1);
+  j.resize(2 * numPairs);
+  for (int p = 0; p < numPairs; p++) {
+    j[fill[pairI[p]]++] = pairJ[p];
+    j[fill[pairJ[p]]++] = pairI[p];
+  }
+}
+
+void NeighborList::build(const SpatialGrid &grid, const glm::vec3 *pos, int n,
+                         float radius) {
+  begin(n);
+  int numCells = grid.NumCells();
+  cellPairs.resize(numCells + 1);
+  for (int c = 0; c < numCells; c++) {
+    cellPairs[c] = NumPairs();
+    grid.forEachPairInCell(c,
+                           [&](int a, int b) { addPair(a, b, pos, radius); });
+  }
+  cellPairs[numCells] = NumPairs();
+  makeRows();
+}
+
+void NeighborList::buildBruteForce(const glm::vec3 *pos, int n,
+                                   float radius) {
+  begin(n);
+  cellPairs.clear();
+  for (int a = 0; a < n; a++) {
+    for (int b = a + 1; b < n; b++) {
+      addPair(a, b, pos, radius);
+    }
+  }
+  makeRows();
+}
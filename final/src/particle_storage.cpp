@@ -0,0 +1,105 @@
+#include "particle_storage.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace {
+
+void *alignedAlloc(size_t bytes) {
+  void *p = nullptr;
+#ifdef _WIN32
+  p = _aligned_malloc(bytes, ParticleStorage::ALIGNMENT);
+#else
+  if (posix_memalign(&p, ParticleStorage::ALIGNMENT, bytes)) p = nullptr;
+#endif
+  if (!p && bytes) throw std::bad_alloc();
+  return p;
+}
+
+void alignedFree(void *p) {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+// Move the first used elements of *array into a new zeroed array of size n
+template <typename T>
+void regrow(T **array, int n, int used) {
+  T *grown = (T *)alignedAlloc(n * sizeof(T));
+  std::fill(grown, grown + n, T());
+  if (*array) std::copy(*array, *array + used, grown);
+  alignedFree(*array);
+  *array = grown;
+}
+
+// Gather the first n elements of array through perm
+template <typename T>
+void gather(T *array, const int *perm, int n) {
+  std::vector<T> old(array, array + n);
+  for (int k = 0; k < n; k++) {
+    array[k] = old[perm[k]];
+  }
+}
+
+}  // namespace
+
+ParticleStorage::ParticleStorage(int capacity)
+    : pos(nullptr),
+      ppos(nullptr),
+      vel(nullptr),
+      col(nullptr),
+      heat(nullptr),
+      id(nullptr),
+      slot(nullptr),
+      capacity(0) {
+  reserve(capacity, 0);
+}
+
+ParticleStorage::~ParticleStorage() {
+  alignedFree(pos);
+  alignedFree(ppos);
+  alignedFree(vel);
+  alignedFree(col);
+  alignedFree(heat);
+  alignedFree(id);
+  alignedFree(slot);
+}
+
+void ParticleStorage::reserve(int n, int used) {
+  if (n <= capacity && pos) return;
+  n = std::max(n, 1);
+  used = std::min(used, capacity);
+  regrow(&pos, n, used);
+  regrow(&ppos, n, used);
+  regrow(&vel, n, used);
+  regrow(&col, n, used);
+  regrow(&heat, n, used);
+  regrow(&id, n, used);
+  regrow(&slot, n, used);
+  capacity = n;
+}
+
+void ParticleStorage::permute(const int *perm, int n) {
+  gather(pos, perm, n);
+  gather(ppos, perm, n);
+  gather(vel, perm, n);
+  gather(col, perm, n);
+  gather(heat, perm, n);
+  gather(id, perm, n);
+  for (int k = 0; k < n; k++) {
+    slot[id[k]] = k;
+  }
+}
+
+void ParticleStorage::grow(int n, int used) {
+  if (n <= capacity) return;
+  reserve(std::max(n, 2 * capacity), used);
+}
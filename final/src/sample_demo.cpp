@@ -1,8 +1,6 @@
 #include "sample_demo.h"
 
-SampleFluidDemo::SampleFluidDemo() : SPHFluid() {
-  maxParticles = 200;
-
+SampleFluidDemo::SampleFluidDemo() : SPHFluid(nullptr, false, 200) {
   boxTop = 0.75;
   boxBottom = 0;
   boxLeft = -0.5;
@@ -10,6 +8,7 @@ SampleFluidDemo::SampleFluidDemo() : SPHFluid() {
   boxFront = 0.5;
   boxBack = -0.5;
 
+  initGrid();
   initVBO();
 }
 
@@ -20,6 +19,11 @@ glm::vec3 SampleFluidDemo::initialParticlePosition(int i) {
   return glm::vec3(x, y, z);
 }
 
+void SampleFluidDemo::initialParticleBounds(glm::vec3 *lo, glm::vec3 *hi) {
+  *lo = glm::vec3(-1.7, 1.2, -0.7);
+  *hi = glm::vec3(-1.5, 1.4, -0.7);
+}
+
 glm::vec3 SampleFluidDemo::initialParticleVelocity(int i) {
   float x = 2 + 0.5 * rand01();
   float y = 2 + 1.5 * rand01();
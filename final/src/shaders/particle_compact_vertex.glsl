@@ -0,0 +1,36 @@
+#version 140
+
+// particle_vertex.glsl for SPHFluid's compact vertices: position and heat
+// arrive normalized to [0, 1], position over the bounds [boundsLo,
+// boundsLo + boundsSize]
+in vec3 position;
+in float heat;
+
+const vec3 inLightDir = normalize(vec3(1,-1,1));
+
+out vec3 Color;
+out vec3 lightDir;
+out vec4 eyePos;
+out mat4 projMat;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 proj;
+uniform vec3 inColor;
+uniform bool useHeat;
+uniform vec3 boundsLo;
+uniform vec3 boundsSize;
+
+const float pointScale = 70;
+void main() {
+  if (useHeat)
+    Color = vec3(heat, 0, 1-heat);
+  else
+    Color = vec3(0.05, 0.35, 1);
+
+  eyePos = view*model*vec4(boundsLo + position*boundsSize, 1.0);
+  gl_PointSize = -pointScale/eyePos.z;
+  gl_Position = proj * eyePos;
+  lightDir = inLightDir;
+  projMat = proj;
+}
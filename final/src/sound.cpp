@@ -1,8 +1,5 @@
 #include "sound.h"
 
-#include <SDL.h>
-#include <SDL_opengl.h>
-
 #include "glm/glm.hpp"
 
 #include <algorithm>
@@ -0,0 +1,174 @@
+#include "spatial_grid.h"
+
+const int SpatialGrid::SHELL[13][3] = {
+    {1, 0, 0},  {-1, 1, 0}, {0, 1, 0},  {1, 1, 0},  {-1, -1, 1},
+    {0, -1, 1}, {1, -1, 1}, {-1, 0, 1}, {0, 0, 1},  {1, 0, 1},
+    {-1, 1, 1}, {0, 1, 1},  {1, 1, 1}};
+
+SpatialGrid::SpatialGrid()
+    : hashed(false),
+      groupMask(0),
+      origin(0, 0, 0),
+      size(1, 1, 1),
+      cellSize(1),
+      invCellSize(1),
+      numCells(1),
+      numParticles(0),
+      incremental(false),
+      valid(false),
+      numMoved(0) {}
+
+void SpatialGrid::init(glm::vec3 origin, glm::ivec3 size, float cellSize) {
+  hashed = false;
+  this->origin = origin;
+  this->size = glm::max(size, 1);
+  this->cellSize = cellSize;
+  invCellSize = 1 / cellSize;
+  numCells = this->size.x * this->size.y * this->size.z;
+  start.assign(numCells + 1, 0);
+  end.assign(numCells, 0);
+  valid = false;
+
+  for (int color = 0; color < NUM_COLORS; color++) {
+    colorCells[color].clear();
+  }
+  for (int c = 0; c < numCells; c++) {
+    int x = c % this->size.x;
+    int y = (c / this->size.x) % this->size.y;
+    int z = c / (this->size.x * this->size.y);
+    colorCells[(z % 3) * 9 + (y % 3) * 3 + x % 3].push_back(c);
+  }
+}
+
+void SpatialGrid::initHashed(float cellSize, int numBuckets) {
+  hashed = true;
+  origin = glm::vec3(0);
+  size = glm::ivec3(1);
+  this->cellSize = cellSize;
+  invCellSize = 1 / cellSize;
+
+  // A power of two of bucket groups
+  unsigned groups = 1;
+  while ((int)groups * NUM_COLORS < numBuckets) groups *= 2;
+  groupMask = groups - 1;
+  numCells = groups * NUM_COLORS;
+  start.assign(numCells + 1, 0);
+  end.assign(numCells, 0);
+  valid = false;
+
+  for (int color = 0; color < NUM_COLORS; color++) {
+    colorCells[color].clear();
+  }
+  for (int c = 0; c < numCells; c++) {
+    colorCells[c % NUM_COLORS].push_back(c);
+  }
+}
+
+// Spread the low 10 bits of x out to every third bit
+static unsigned expandBits(unsigned x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+unsigned SpatialGrid::mortonCode(const glm::vec3 &p) const {
+  // Hashed grids are unbounded, so their coordinates wrap around
+  glm::ivec3 g = gridPos(p);
+  g = hashed ? g + 512 : clampGridPos(g);
+  return (expandBits(g.z) << 2) | (expandBits(g.y) << 1) | expandBits(g.x);
+}
+
+void SpatialGrid::build(const glm::vec3 *pos, int n) {
+  // vector::resize never gives memory back, so these only allocate when the
+  // particle count reaches a new high
+  if ((int)cell.size() < n) {
+    cell.resize(n);
+    where.resize(n);
+    snapshot.resize(n);
+  }
+  if (hashed && (int)coord.size() < n) coord.resize(n);
+  numParticles = n;
+  numMoved = 0;
+  valid = true;
+  std::copy(pos, pos + n, snapshot.begin());
+
+  // Count particles per cell
+  std::fill(start.begin(), start.end(), 0);
+  for (int i = 0; i < n; i++) {
+    if (hashed) {
+      coord[i] = gridPos(pos[i]);
+      cell[i] = bucketId(coord[i]);
+    } else {
+      cell[i] = cellId(pos[i]);
+    }
+    start[cell[i]]++;
+  }
+
+  // Exclusive prefix sum gives the first slot of each cell. Incremental
+  // grids leave room after each cell for particles that move in later.
+  int sum = 0;
+  for (int c = 0; c < numCells; c++) {
+    int count = start[c];
+    start[c] = sum;
+    end[c] = sum;
+    sum += incremental ? count + count / 4 + 4 : count;
+  }
+  start[numCells] = sum;
+  if ((int)sorted.size() < sum) sorted.resize(sum);
+
+  // Scatter, leaving end one past the last particle of each cell
+  for (int i = 0; i < n; i++) {
+    where[i] = end[cell[i]]++;
+    sorted[where[i]] = i;
+  }
+}
+
+bool SpatialGrid::update(const glm::vec3 *pos, int n, float maxMoved) {
+  if (!incremental || !valid || n != numParticles) {
+    build(pos, n);
+    return false;
+  }
+
+  // Find the particles that changed cells
+  moves.clear();
+  for (int i = 0; i < n; i++) {
+    int c;
+    if (hashed) {
+      // A particle can change cells without changing buckets
+      coord[i] = gridPos(pos[i]);
+      c = bucketId(coord[i]);
+    } else {
+      c = cellId(pos[i]);
+    }
+    if (c != cell[i]) moves.push_back(std::make_pair(i, c));
+  }
+  if (moves.size() > maxMoved * n) {
+    build(pos, n);
+    return false;
+  }
+
+  // Move each one to the end of its new cell, filling the hole it leaves
+  // with the last particle of its old cell
+  for (size_t m = 0; m < moves.size(); m++) {
+    int i = moves[m].first, c = moves[m].second;
+    if (end[c] == start[c + 1]) {
+      // Out of room
+      build(pos, n);
+      return false;
+    }
+    int last = sorted[--end[cell[i]]];
+    sorted[where[i]] = last;
+    where[last] = where[i];
+
+    where[i] = end[c]++;
+    sorted[where[i]] = i;
+    cell[i] = c;
+  }
+
+  std::copy(pos, pos + n, snapshot.begin());
+  numMoved = moves.size();
+  return true;
+}
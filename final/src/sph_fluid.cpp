@@ -1,7 +1,11 @@
 #include "sph_fluid.h"
+#include "checkpoint.h"
 #include "sound.h"
+#include "sph_kernels.h"
 
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
@@ -16,24 +20,79 @@
 
 // #define DEBUG
 
+// Check the neighbor grid against brute force before every phase that uses it
+// #define VALIDATE_GRID
+
 const glm::vec3 SPHFluid::GRAVITY(0, -9.8, 0);
 const int SPHFluid::BOX_VERTICES = 24;
-
-SPHFluid::SPHFluid(SpringSystem *ss, bool heat)
+const unsigned SPHFluid::CHECKPOINT_VERSION = 2;
+
+namespace {
+
+// Scalar state of a checkpoint, in the STAT section
+struct FluidState {
+  int32_t numParticles, maxParticles, simSteps, reorderInterval;
+  int32_t useHeat, clothWidth, clothHeight;  // Cloth size 0 without cloth
+  float spawnError, spawnRate;
+  float h, r, skin, sig, bet, g, a, ks, k, knear, p0;
+  float boxTop, boxBottom, boxLeft, boxRight, boxFront, boxBack, boxWallWidth;
+  float sphereR, spherePos[3];
+  int64_t substepCount;
+};
+
+// Largest capacity a checkpoint may ask for beyond the particles it holds
+// and the capacity of the fluid loading it
+const int32_t MAX_CHECKPOINT_CAPACITY = 1 << 20;
+
+const uint32_t TAG_STATE = checkpointTag("STAT");
+const uint32_t TAG_POS = checkpointTag("POS ");
+const uint32_t TAG_PPOS = checkpointTag("PPOS");
+const uint32_t TAG_VEL = checkpointTag("VEL ");
+const uint32_t TAG_COL = checkpointTag("COL ");
+const uint32_t TAG_HEAT = checkpointTag("HEAT");
+const uint32_t TAG_ID = checkpointTag("ID  ");
+const uint32_t TAG_SPRING_I = checkpointTag("SPRI");
+const uint32_t TAG_SPRING_J = checkpointTag("SPRJ");
+const uint32_t TAG_SPRING_REST = checkpointTag("SPRL");
+const uint32_t TAG_CLOTH_POS = checkpointTag("CPOS");
+const uint32_t TAG_CLOTH_VEL = checkpointTag("CVEL");
+
+}  // namespace
+
+SPHFluid::SPHFluid(SpringSystem *ss, bool heat, int maxParticles)
     : numParticles(0),
-      maxParticles(1000),
-      pos(new glm::vec3[maxParticles]),
-      ppos(new glm::vec3[maxParticles]),
-      vel(new glm::vec3[maxParticles]),
-      col(new glm::vec3[maxParticles]),
-      heat(new float[maxParticles]),
-      vboData(new float[4 * (BOX_VERTICES + maxParticles)]),
+      maxParticles(maxParticles),
+      particles(maxParticles),
+      pos(particles.pos),
+      ppos(particles.ppos),
+      vel(particles.vel),
+      col(particles.col),
+      heat(particles.heat),
+      vboData(new float[4 * (BOX_VERTICES + particles.Capacity())]),
+      compactVbo(false),
+      packedLo(0),
+      packedHi(0),
       spawnError(0.),
       spawnRate(maxParticles / 1.),
       simSteps(1),
+      reorderInterval(60),
+      substepCount(0),
+      parallelRelaxation(true),
+      parallelViscosity(true),
+      sleeping(false),
+      sleepSpeed(0.25),
+      sleepPressure(0.3),
+      sleepHeat(0.01),
+      sleepSteps(30),
+      courant(0),
+      maxSimSteps(64),
+      frameBudget(0),
+      substepCost(0),
+      lastSteps(1),
       // Tuning parameters
       h(0.2),
       r(0.02),
+      skin(0),
       sig(2),
       bet(0),
       g(0.1),
@@ -50,28 +109,274 @@ SPHFluid::SPHFluid(SpringSystem *ss, bool heat)
       boxFront(0.5),
       boxBack(-0.5),
       boxWallWidth(0.25),
-      gridRes(h),
-      gridSize(glm::vec3((boxRight - boxLeft) / gridRes,
-                         (boxTop - boxBottom) / gridRes, 1)),
-      worldOrigin(glm::vec3(boxLeft, boxBottom, 0)),
-      particleHash(new glm::ivec2[maxParticles]),
-      cellStart(new int[maxParticles]),
-      maxCellId(gridSize.x * gridSize.y * gridSize.z),
+      gridRes(h + skin),
+      hashedGrid(false),
+      gridRebuildFraction(0.1),
+      neighborsFresh(false),
       ss(ss),
       useHeat(heat) {
+  initGrid();
+  initClothTriangles();
+  initVBO();
+}
+
+SPHFluid::~SPHFluid() { delete[] vboData; }
+
+void SPHFluid::SetNeighborSkin(float s) {
+  skin = s;
+  gridRes = h + skin;
+  initGrid();
+
+  // Force a rebuild at the new radius
+  neighbors.invalidate();
+}
+
+void SPHFluid::SetHashedGrid(bool hashed) {
+  hashedGrid = hashed;
+  initGrid();
+
+  // Cell ids changed
+  neighbors.invalidate();
+}
+
+void SPHFluid::SetIncrementalGrid(bool inc) {
+  grid.setIncremental(inc);
+  grid.invalidate();
+}
+
+void SPHFluid::SetSleeping(bool s) {
+  sleeping = s;
+  asleep.assign(numParticles, 0);
+  cellQuiet.clear();
+}
+
+void SPHFluid::SetAdaptiveSteps(float c, int maxSteps, float budgetMs) {
+  courant = c;
+  maxSimSteps = std::max(maxSteps, 1);
+  frameBudget = budgetMs;
+}
+
+bool SPHFluid::saveCheckpoint(const char *path) {
+  FluidState s;
+  std::memset(&s, 0, sizeof(s));
+  s.numParticles = numParticles;
+  s.maxParticles = maxParticles;
+  s.simSteps = simSteps;
+  s.reorderInterval = reorderInterval;
+  s.substepCount = substepCount;
+  s.useHeat = useHeat;
+  s.spawnError = spawnError;
+  s.spawnRate = spawnRate;
+  s.h = h;
+  s.r = r;
+  s.skin = skin;
+  s.sig = sig;
+  s.bet = bet;
+  s.g = g;
+  s.a = a;
+  s.ks = ks;
+  s.k = k;
+  s.knear = knear;
+  s.p0 = p0;
+  s.boxTop = boxTop;
+  s.boxBottom = boxBottom;
+  s.boxLeft = boxLeft;
+  s.boxRight = boxRight;
+  s.boxFront = boxFront;
+  s.boxBack = boxBack;
+  s.boxWallWidth = boxWallWidth;
+  if (ss) {
+    s.clothWidth = ss->width;
+    s.clothHeight = ss->height;
+    s.sphereR = ss->sphereR;
+    s.spherePos[0] = ss->spherePos.x;
+    s.spherePos[1] = ss->spherePos.y;
+    s.spherePos[2] = ss->spherePos.z;
+  }
+
+  CheckpointWriter out(CHECKPOINT_VERSION);
+  out.add(TAG_STATE, &s, sizeof(s));
+  out.add(TAG_POS, pos, numParticles * sizeof(pos[0]));
+  out.add(TAG_PPOS, ppos, numParticles * sizeof(ppos[0]));
+  out.add(TAG_VEL, vel, numParticles * sizeof(vel[0]));
+  out.add(TAG_COL, col, numParticles * sizeof(col[0]));
+  out.add(TAG_HEAT, heat, numParticles * sizeof(heat[0]));
+  out.add(TAG_ID, particles.id, numParticles * sizeof(particles.id[0]));
+  out.add(TAG_SPRING_I, springs.Is(), springs.Size() * sizeof(int));
+  out.add(TAG_SPRING_J, springs.Js(), springs.Size() * sizeof(int));
+  out.add(TAG_SPRING_REST, springs.Rests(), springs.Size() * sizeof(float));
+  if (ss) {
+    out.add(TAG_CLOTH_POS, ss->pos, ss->numNodes * sizeof(ss->pos[0]));
+    out.add(TAG_CLOTH_VEL, ss->vel1, ss->numNodes * sizeof(ss->vel1[0]));
+  }
+  return out.write(path);
+}
+
+bool SPHFluid::loadCheckpoint(const char *path) {
+  CheckpointReader in;
+  if (!in.open(path)) return false;
+  FluidState s;
+  if (in.Version() != CHECKPOINT_VERSION) {
+    fprintf(stderr, "%s: unsupported checkpoint version %u\n", path,
+            in.Version());
+    return false;
+  }
+  if (!in.read(TAG_STATE, &s, 1)) {
+    fprintf(stderr, "%s: corrupt checkpoint\n", path);
+    return false;
+  }
+
+  // Check every section before touching any state
+  int n = s.numParticles;
+  size_t springBytes = 0;
+  const int *si = nullptr, *sj = nullptr;
+  const float *sL = nullptr;
+  size_t bytes;
+  // maxParticles sizes the particle storage and hashed grid, and h + skin
+  // the grid cells, so bad ones could ask for gigabytes no section backs
+  int32_t capacity =
+      std::max(n, std::max(maxParticles, MAX_CHECKPOINT_CAPACITY));
+  bool ok = n >= 0 && n <= s.maxParticles && s.maxParticles <= capacity;
+  ok = ok && std::isfinite(s.h) && s.h > 0 && std::isfinite(s.skin) &&
+       s.skin >= 0;
+  const uint32_t vecTags[] = {TAG_POS, TAG_PPOS, TAG_VEL, TAG_COL};
+  for (int t = 0; t < 4 && ok; t++) {
+    ok = in.section(vecTags[t], &bytes) && bytes == n * sizeof(glm::vec3);
+  }
+  ok = ok && in.section(TAG_HEAT, &bytes) && bytes == n * sizeof(float);
+  const int *ids = ok ? (const int *)in.section(TAG_ID, &bytes) : nullptr;
+  ok = ids && bytes == n * sizeof(int);
+  // Ids must be a permutation of 0..n-1 for particles.slot to invert them
+  std::vector<char> seen(ok ? n : 0, 0);
+  for (int k = 0; ok && k < n; k++) {
+    ok = ids[k] >= 0 && ids[k] < n && !seen[ids[k]];
+    if (ok) seen[ids[k]] = 1;
+  }
+  if (ok) {
+    si = (const int *)in.section(TAG_SPRING_I, &springBytes);
+    sj = (const int *)in.section(TAG_SPRING_J, &bytes);
+    ok = si && sj && bytes == springBytes;
+    sL = (const float *)in.section(TAG_SPRING_REST, &bytes);
+    ok = ok && sL && bytes == springBytes;
+  }
+  int numSprings = (int)(springBytes / sizeof(int));
+  for (int t = 0; ok && t < numSprings; t++) {
+    ok = si[t] >= 0 && si[t] < n && sj[t] >= 0 && sj[t] < n;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: corrupt checkpoint\n", path);
+    return false;
+  }
+  bool cloth = ss && s.clothWidth == ss->width && s.clothHeight == ss->height;
+  if (ss && !cloth) {
+    fprintf(stderr, "%s: checkpoint cloth is %dx%d, not %dx%d\n", path,
+            s.clothWidth, s.clothHeight, ss->width, ss->height);
+    return false;
+  }
+  if (cloth) {
+    size_t nodeBytes = ss->numNodes * sizeof(glm::vec3);
+    if (!in.section(TAG_CLOTH_POS, &bytes) || bytes != nodeBytes ||
+        !in.section(TAG_CLOTH_VEL, &bytes) || bytes != nodeBytes) {
+      fprintf(stderr, "%s: corrupt checkpoint\n", path);
+      return false;
+    }
+  }
+
+  maxParticles = s.maxParticles;
+  simSteps = s.simSteps;
+  reorderInterval = s.reorderInterval;
+  substepCount = s.substepCount;
+  useHeat = s.useHeat != 0;
+  spawnError = s.spawnError;
+  spawnRate = s.spawnRate;
+  h = s.h;
+  r = s.r;
+  skin = s.skin;
+  sig = s.sig;
+  bet = s.bet;
+  g = s.g;
+  a = s.a;
+  ks = s.ks;
+  k = s.k;
+  knear = s.knear;
+  p0 = s.p0;
+  boxTop = s.boxTop;
+  boxBottom = s.boxBottom;
+  boxLeft = s.boxLeft;
+  boxRight = s.boxRight;
+  boxFront = s.boxFront;
+  boxBack = s.boxBack;
+  boxWallWidth = s.boxWallWidth;
+
+  // Particles are copied straight out of the mapped sections
+  reserveParticles(maxParticles);
+  numParticles = n;
+  in.read(TAG_POS, pos, n);
+  in.read(TAG_PPOS, ppos, n);
+  in.read(TAG_VEL, vel, n);
+  in.read(TAG_COL, col, n);
+  in.read(TAG_HEAT, heat, n);
+  in.read(TAG_ID, particles.id, n);
+  for (int i = 0; i < n; i++) {
+    particles.slot[particles.id[i]] = i;
+  }
+  springs.assign(si, sj, sL, numSprings);
+
+  if (cloth) {
+    in.read(TAG_CLOTH_POS, ss->pos, ss->numNodes);
+    in.read(TAG_CLOTH_VEL, ss->vel1, ss->numNodes);
+    ss->sphereR = s.sphereR;
+    ss->spherePos = glm::vec3(s.spherePos[0], s.spherePos[1], s.spherePos[2]);
+    ss->updateVertices();
+    updateClothTriangles();
+  }
+
+  // Everything derived from positions and parameters starts over
+  gridRes = h + skin;
+  initGrid();
+  grid.invalidate();
+  neighbors.invalidate();
+  asleep.assign(numParticles, 0);
+  lastPressure.clear();
+  lastHeat.clear();
+  pressure.clear();
+  pressureNear.clear();
+  substepCost = 0;
   initVBO();
+  updateVBO();
+  return true;
+}
+
+void SPHFluid::SetMaxParticles(int n) {
+  maxParticles = n;
+  reserveParticles(n);
+
+  // The hashed grid's bucket table is sized by maxParticles
+  if (hashedGrid) {
+    initGrid();
+    neighbors.invalidate();
+  }
 }
 
-SPHFluid::~SPHFluid() {
-  delete[] pos;
-  delete[] ppos;
-  delete[] vel;
+void SPHFluid::reserveParticles(int n) {
+  if (n <= particles.Capacity()) return;
+  particles.grow(n, numParticles);
+  pos = particles.pos;
+  ppos = particles.ppos;
+  vel = particles.vel;
+  col = particles.col;
+  heat = particles.heat;
+
+  // Keep the box vertices and particles uploaded so far
+  float *grown = new float[4 * (BOX_VERTICES + particles.Capacity())];
+  std::copy(vboData, vboData + 4 * (BOX_VERTICES + numParticles), grown);
   delete[] vboData;
-  delete[] particleHash;
-  delete[] cellStart;
+  vboData = grown;
 }
 
 void SPHFluid::newParticle(int i) {
+  particles.id[i] = i;
+  particles.slot[i] = i;
   pos[i] = initialParticlePosition(i);
   vel[i] = initialParticleVelocity(i);
   heat[i] = initialParticleHeat(i);
@@ -82,6 +387,7 @@ void SPHFluid::spawnNewParticles() {
     float numNewParticlesExact = spawnRate * dt;
     int numNewParticles = int(numNewParticlesExact) + int(spawnError);
     spawnError += std::fmod(numNewParticlesExact, 1.) - int(spawnError);
+    reserveParticles(std::min(numParticles + numNewParticles, maxParticles));
     for (int i = 0; i < numNewParticles && numParticles < maxParticles; i++) {
       newParticle(numParticles);
       numParticles++;
@@ -90,33 +396,94 @@ void SPHFluid::spawnNewParticles() {
 }
 
 void SPHFluid::update(float delta) {
-  if (ss) ss->update(delta);
+  int steps = simSteps;
   dt = delta / (float)simSteps;
-  NeighborSet n;
-  for (int waka = 0; waka < simSteps; waka++) {
+  if (courant > 0) {
+    steps = planSubsteps(delta);
+    delta = steps * dt;
+  }
+  lastSteps = steps;
+  auto start = std::chrono::steady_clock::now();
+
+  if (ss) {
+    ss->update(delta);
+
+    // The cloth only moves here, so its triangles are set up once for all
+    // substeps
+    PhaseTimer t(&stats, PHASE_CLOTH);
+    updateClothTriangles();
+  }
+  for (int waka = 0; waka < steps; waka++) {
+    // Particles spawned last substep start awake
+    asleep.resize(numParticles, 0);
+
     // Apply gravity
     for (int i = 0; i < numParticles; i++) {
+      if (asleep[i]) continue;
       vel[i] += dt * GRAVITY;
     }
 
-    applyViscosity();
+    if (reorderInterval > 0 && substepCount % reorderInterval == 0) {
+      reorderParticles();
+    }
+
+    // Build the neighbor grid and lists from the current positions, for
+    // viscosity and heat transfer
+    makeGrid();
+
+    {
+#ifdef VALIDATE_GRID
+      validateGrid("applyViscosity");
+#endif
+      PhaseTimer t(&stats, PHASE_VISCOSITY);
+      applyViscosity();
+    }
 
-    if (useHeat) transferHeat();
+    if (useHeat) {
+#ifdef VALIDATE_GRID
+      validateGrid("transferHeat");
+#endif
+      PhaseTimer t(&stats, PHASE_HEAT);
+      transferHeat();
+    }
 
     for (int i = 0; i < numParticles; i++) {
       // Save previous positions
       ppos[i] = pos[i];
       // Go to predicted position
-      pos[i] += dt * vel[i];
+      if (!asleep[i]) pos[i] += dt * vel[i];
     }
 
-    updateSprings();
+    // Particles have moved by dt * vel, so the lists are rebuilt if they no
+    // longer hold every pair within h. Springs move particles again before
+    // relaxation.
+    makeGrid();
+    {
+#ifdef VALIDATE_GRID
+      validateGrid("updateSprings");
+#endif
+      PhaseTimer t(&stats, PHASE_SPRINGS);
+      updateSprings();
+    }
 
-    doubleDensityRelaxation();
+    makeGrid();
+    {
+#ifdef VALIDATE_GRID
+      validateGrid("doubleDensityRelaxation");
+#endif
+      PhaseTimer t(&stats, PHASE_RELAXATION);
+      doubleDensityRelaxation();
+    }
 
-    resolveCollisions();
+    {
+      PhaseTimer t(&stats, PHASE_COLLISIONS);
+      resolveCollisions();
+    }
 
-    clothInteraction();
+    {
+      PhaseTimer t(&stats, PHASE_CLOTH);
+      clothInteraction();
+    }
 
     // Compute next velocity
     for (int i = 0; i < numParticles; i++) {
@@ -130,136 +497,217 @@ void SPHFluid::update(float delta) {
 #endif
     }
 
+    if (sleeping) updateSleeping();
+
+    substepCount++;
+    stats.steps++;
+    stats.particleSteps += numParticles;
+
     spawnNewParticles();
   }
+
+  double ns = std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  substepCost = substepCost > 0 ? (substepCost + ns / steps) / 2 : ns / steps;
+  stats.frames++;
+  stats.simTime += delta;
+  stats.maxSubsteps = std::max(stats.maxSubsteps, steps);
+
   updateVBO();
 }
 
+int SPHFluid::planSubsteps(float delta) {
+  // Fastest particle by the end of the frame, if gravity pulled on it the
+  // whole time
+  float maxSpeed2 = 0;
+  for (int i = 0; i < numParticles; i++) {
+    maxSpeed2 = std::fmax(maxSpeed2, glm::dot(vel[i], vel[i]));
+  }
+  float maxSpeed = std::sqrt(maxSpeed2) + glm::length(GRAVITY) * delta;
+
+  // Substeps needed so that no particle moves more than courant * h in one
+  float needed = std::ceil(maxSpeed * delta / (courant * h));
+  int steps = (int)std::fmin(std::fmax(needed, (float)simSteps), 1e6f);
+  dt = delta / steps;
+
+  // Past the cap or the budget, take fewer steps of the same size and let
+  // the fluid fall behind rather than go unstable
+  int cap = maxSimSteps;
+  if (frameBudget > 0 && substepCost > 0) {
+    cap = std::min(cap, std::max(1, (int)(frameBudget * 1e6 / substepCost)));
+  }
+  if (steps > cap) {
+    steps = cap;
+    stats.slowFrames++;
+  }
+  return steps;
+}
+
 void SPHFluid::applyViscosity() {
-  makeGrid();
+  // Reuse distances if the lists were built this substep, otherwise
+  // recompute them for all pairs up front
+  int numPairs = neighbors.NumPairs();
+  const float *dist = neighbors.PairDists();
+  const glm::vec3 *dir = neighbors.PairDirs();
+  if (!neighborsFresh) {
+    pairDist.resize(numPairs);
+    pairDir.resize(numPairs);
+    const int CHUNK = 1024;
+#pragma omp parallel for schedule(static)
+    for (int p = 0; p < numPairs; p += CHUNK) {
+      sphPairGeometry(pos, neighbors.PairIs() + p, neighbors.PairJs() + p,
+                      std::min(CHUNK, numPairs - p), &pairDist[p],
+                      &pairDir[p]);
+    }
+    dist = pairDist.data();
+    dir = pairDir.data();
+  }
 
   // Apply viscosity
-  glm::vec3 rij, I;
-  for (int i = 0; i < numParticles; i++) {
-    getNeighbors(i, &n, true);
-    for (int ii = 0; ii < n.size; ii++) {
-      int j = n.n[ii];
-      float dist = glm::length(pos[i] - pos[j]);
-      float q = dist / h;
-      // Inward radial velocity
-      rij = glm::normalize(pos[i] - pos[j]);
-      float u = glm::dot(vel[i] - vel[j], rij);
-      if (u > 0) {
-        // Linear and quadratic impulses
-        I = dt * (1 - q) * (sig * u + bet * u * u) * rij;
-
-        vel[i] -= I / 2.f;
-        vel[j] += I / 2.f;
-      }
+  if (!parallelViscosity || !neighbors.HasCells()) {
+    for (int p = 0; p < numPairs; p++) {
+      applyViscosityPair(p, dist[p], dir[p]);
     }
+    return;
   }
-}
-
-void SPHFluid::updateSprings() {
-  makeGrid();
 
-  // Adjust springs
-  std::pair<int, int> key;
-  float L, d;
-  for (int i = 0; i < numParticles; i++) {
-    getNeighbors(i, &n, true);
-    for (int ii = 0; ii < n.size; ii++) {
-      int j = n.n[ii];
-      float dist = glm::length(pos[i] - pos[j]);
-
-      // Insert new spring if it doesn't exist
-      bool exists = true;
-      auto iLo = std::lower_bound(sp1.begin(), sp1.end(), i);
-      auto iHi = std::upper_bound(sp1.begin(), sp1.end(), i);
-      auto jLo = sp2.begin() + (iLo - sp1.begin());
-      auto jHi = sp2.begin() + (iHi - sp1.begin());
-      auto jPos = std::lower_bound(jLo, jHi, j);
-      int offset = jPos - sp2.begin();
-      if (iLo == sp1.end() || jPos == jHi) exists = false;
-      if (!exists) {
-        sp1.insert(iLo, i);
-        sp2.insert(jPos, j);
-        spL.insert(spL.begin() + offset, h);
+  // Pairs of same colored cells never share a particle, so each color is
+  // processed in parallel. The result doesn't depend on the thread count.
+  for (int color = 0; color < SpatialGrid::NUM_COLORS; color++) {
+    const std::vector<int> &cells = grid.ColorCells(color);
+    int numCells = cells.size();
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int cc = 0; cc < numCells; cc++) {
+      int end = neighbors.CellPairsEnd(cells[cc]);
+      for (int p = neighbors.CellPairsBegin(cells[cc]); p < end; p++) {
+        applyViscosityPair(p, dist[p], dir[p]);
       }
+    }
+  }
+}
 
-      float &Lij = spL[offset];
-      // Assuming Lij = L from the paper
-      L = Lij;
+void SPHFluid::applyViscosityPair(int p, float dist, const glm::vec3 &rij) {
+  if (dist >= h) return;
+  int i = neighbors.PairI(p);
+  int j = neighbors.PairJ(p);
+  if (asleep[i] && asleep[j]) return;
+  float q = dist / h;
+  // Inward radial velocity
+  float u = glm::dot(vel[i] - vel[j], rij);
+  if (u > 0) {
+    // Linear and quadratic impulses
+    glm::vec3 I = dt * (1 - q) * (sig * u + bet * u * u) * rij;
+
+    // Sleeping particles are static
+    if (!asleep[i]) vel[i] -= I / 2.f;
+    if (!asleep[j]) vel[j] += I / 2.f;
+  }
+}
 
-      // Tolerable deformation = yield ratio * rest length
-      d = g * Lij;
-      if (dist > L + d) {
-        Lij += dt * a * (dist - L - d);
-      } else if (dist < L - d) {
-        Lij -= dt * a * (L - d - dist);
-      }
-    }
+void SPHFluid::updateSprings() {
+  // Insert new springs between neighbors
+  int numPairs = neighbors.NumPairs();
+  for (int p = 0; p < numPairs; p++) {
+    int i = neighbors.PairI(p);
+    int j = neighbors.PairJ(p);
+    if (asleep[i] && asleep[j]) continue;
+    // Particles have moved since the list was built
+    float dist = glm::length(pos[i] - pos[j]);
+    // Coincident particles have no direction to pull along
+    if (dist >= h || dist <= SPH_MIN_DIST) continue;
+    springs.insert(i, j, h);
   }
-  for (auto it = spL.begin(); it != spL.end();) {
-    if (*it > h) {
-      int offset = it - spL.begin();
-      sp1.erase(sp1.begin() + offset);
-      sp2.erase(sp2.begin() + offset);
-      it = spL.erase(it);
-    } else {
-      it++;
+
+  // Adjust springs. Every spring yields, including those whose particles
+  // have moved out of each other's range, so a stretched spring's rest
+  // length grows past h and it is removed instead of pulling forever.
+  int numSprings = springs.Size();
+#pragma omp parallel for schedule(static)
+  for (int t = 0; t < numSprings; t++) {
+    int i = springs.I(t), j = springs.J(t);
+    if (asleep[i] && asleep[j]) continue;
+    float dist = glm::length(pos[i] - pos[j]);
+    // Assuming Lij = L from the paper
+    float &Lij = springs.Rest(t);
+    float L = Lij;
+
+    // Tolerable deformation = yield ratio * rest length
+    float d = g * Lij;
+    if (dist > L + d) {
+      Lij += dt * a * (dist - L - d);
+    } else if (dist < L - d) {
+      Lij -= dt * a * (L - d - dist);
     }
   }
-
-  // Apply spring displacements
-  glm::vec3 v, D;
-  for (int t = 0; t < spL.size(); t++) {
-    int i = sp1[t];
-    int j = sp2[t];
-    v = pos[j] - pos[i];
+  springs.removeLongerThan(h);
+
+  // Apply spring displacements. Each one is computed from the positions at
+  // the start of the pass, in parallel, then they are added up in order.
+  numSprings = springs.Size();
+  springDisp.resize(numSprings);
+#pragma omp parallel for schedule(static)
+  for (int t = 0; t < numSprings; t++) {
+    if (asleep[springs.I(t)] && asleep[springs.J(t)]) continue;
+    glm::vec3 v = pos[springs.J(t)] - pos[springs.I(t)];
     float dist = glm::length(v);
-    D = dt * dt * ks * (1 - spL[t] / h) * (spL[t] - dist) * glm::normalize(v);
-
-    pos[i] += D / -2.f;
-    pos[j] += D / 2.f;
+    float Lij = springs.Rest(t);
+    springDisp[t] = dist > SPH_MIN_DIST
+                        ? dt * dt * ks * (1 - Lij / h) * (Lij - dist) * v / dist
+                        : glm::vec3(0);
+  }
+  for (int t = 0; t < numSprings; t++) {
+    int i = springs.I(t), j = springs.J(t);
+    if (asleep[i] && asleep[j]) continue;
+    if (!asleep[i]) pos[i] += springDisp[t] / -2.f;
+    if (!asleep[j]) pos[j] += springDisp[t] / 2.f;
   }
 }
 
 void SPHFluid::doubleDensityRelaxation() {
-  makeGrid();
+  if (parallelRelaxation) {
+    doubleDensityRelaxationJacobi();
+  } else {
+    doubleDensityRelaxationSerial();
+  }
+}
 
-  // Double density relaxation
+void SPHFluid::doubleDensityRelaxationSerial() {
+  // Double density relaxation, Gauss-Seidel style: each particle sees the
+  // displacements of the particles before it.
+  // Particles have moved since the neighbor list was built, so distances are
+  // recomputed once per pair in the density pass. pos[i] doesn't change until
+  // the end of its iteration and each pos[j] only after its own displacement
+  // is computed, so the displacement pass can reuse them.
+  liveDist.resize(neighbors.NumEntries());
+  pressure.resize(numParticles);
   float p, pn;
   for (int i = 0; i < numParticles; i++) {
+    // Sleeping particles keep their last pressure
+    if (asleep[i]) continue;
     p = 0;
     pn = 0;
+    int end = neighbors.End(i);
 
     // Compute density and near-density
-    getNeighbors(i, &n);
-    for (int ii = 0; ii < n.size; ii++) {
-      int j = n.n[ii];
-      float dist = glm::length(pos[i] - pos[j]);
-      float q = dist / h;
-      if (q < 1) {
-        p += powf(1 - q, 2);
-        pn += powf(1 - q, 3);
-      }
-    }
+    sphDensity(pos[i], pos, neighbors.Neighbors(i), end - neighbors.Begin(i),
+               h, liveDist.data() + neighbors.Begin(i), &p, &pn);
 
     // Compute pressure and near-pressure
     float pres = k * (p - p0);
     float presn = knear * pn;
+    pressure[i] = pres;
 
-    glm::vec3 dx, D;
-    for (int ii = 0; ii < n.size; ii++) {
-      int j = n.n[ii];
-      float dist = glm::length(pos[i] - pos[j]);
+    glm::vec3 dx(0), D;
+    for (int ii = neighbors.Begin(i); ii < end; ii++) {
+      int j = neighbors.Neighbor(ii);
+      float dist = liveDist[ii];
       float q = dist / h;
-      if (q < 1) {
+      if (q < 1 && dist > SPH_MIN_DIST) {
         // Apply displacements
         D = dt * dt * (pres * (1 - q) + presn * (1 - q) * (1 - q)) *
-            glm::normalize(pos[j] - pos[i]);
-        pos[j] += D / 2.f;
+            (pos[j] - pos[i]) / dist;
+        if (!asleep[j]) pos[j] += D / 2.f;
         dx -= D / 2.f;
       }
     }
@@ -267,6 +715,50 @@ void SPHFluid::doubleDensityRelaxation() {
   }
 }
 
+void SPHFluid::doubleDensityRelaxationJacobi() {
+  // Double density relaxation, Jacobi style: every displacement is computed
+  // from the positions at the start of the phase. Both passes only write to
+  // particle i, so they run in parallel without atomics and each sum is taken
+  // in the same order no matter how many threads there are.
+  liveDist.resize(neighbors.NumEntries());
+  pressure.resize(numParticles);
+  pressureNear.resize(numParticles);
+  disp.resize(numParticles);
+
+  // Compute density and near-density, then pressure and near-pressure
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < numParticles; i++) {
+    // Sleeping particles keep their last pressure
+    if (asleep[i]) continue;
+    float p, pn;
+    int begin = neighbors.Begin(i);
+    sphDensity(pos[i], pos, neighbors.Neighbors(i), neighbors.End(i) - begin,
+               h, liveDist.data() + begin, &p, &pn);
+    pressure[i] = k * (p - p0);
+    pressureNear[i] = knear * pn;
+  }
+
+  // Gather the displacements the serial sweep would scatter: i's own push
+  // on j moves i by -D_ij / 2, and j's push on i moves it by D_ji / 2
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < numParticles; i++) {
+    if (asleep[i]) {
+      disp[i] = glm::vec3(0);
+      continue;
+    }
+    int begin = neighbors.Begin(i);
+    glm::vec3 dx = sphDisplacement(
+        pos[i], pressure[i], pressureNear[i], pos, pressure.data(),
+        pressureNear.data(), neighbors.Neighbors(i), liveDist.data() + begin,
+        neighbors.End(i) - begin, h, dt);
+    disp[i] = dx;
+  }
+
+  for (int i = 0; i < numParticles; i++) {
+    pos[i] += disp[i];
+  }
+}
+
 void SPHFluid::resolveCollisions() {
   // Resolve collisions
   glm::vec3 norm, vn, vt, v, I;
@@ -352,43 +844,53 @@ void SPHFluid::transferHeat() {
   // = temps, d = thickness of barrier simplify to spring Q/t = k(T1 - T2) / d,
   // where k is tuning param and d is distance also need to convect particles
   // relative to surrounding heat
-  float k = 0.003;
-  float pull = .008;
-  float damp = 0.005;
-  float pheat[maxParticles];
-  for (int i = 0; i < numParticles; i++) {
-    pheat[i] = heat[i];
-  }
-
-  // calculate transfer of heat
+  // Amounts below are per 1 / 240 s step, scale them to the actual step so
+  // that substepping doesn't multiply them
+  float s = dt / (1 / 240.f);
+  float k = 0.003 * s;
+  float pull = .008 * s;
+  float damp = 0.005 * s;
+  pheat.assign(heat, heat + numParticles);
+
+  // calculate transfer of heat. Sleeping particles exchange heat but aren't
+  // moved; updateSleeping wakes them when their heat changes quickly.
   for (int i = 0; i < numParticles; i++) {
     // heat the corners of the box
     if (ppos[i].y < boxBottom + r * 2 &&
         (ppos[i].x < boxLeft + r * 3 || ppos[i].x > boxRight - r * 3)) {
-      // stimulate motion, prevents deadlock
-      pos[i].y += .002;
+      // stimulate motion, prevents deadlock, so these never sleep
+      asleep[i] = 0;
+      pos[i].y += .002 * s;
       // add heat
-      heat[i] += .01;
+      heat[i] += .01 * s;
     }
 
-    getNeighbors(i, &n);
+    // Uses the neighbor list built at the start of the substep in update()
+    int end = neighbors.End(i);
 
     // how many neighbors are in direct vicinity and "above"
     int aboveNeighbors = 0;
 
-    for (int j = 0; j < n.size; j++) {
-      if (glm::length(ppos[i] - ppos[n.n[j]]) <= 4.0 * r ||
-          (ppos[i].y < r && glm::length(ppos[i] - ppos[n.n[j]]) < 10.0 * r)) {
-        heat[i] -= k * (pheat[i] - pheat[n.n[j]]) / 2.0;
-        heat[n.n[j]] += k * (pheat[i] - pheat[n.n[j]]) / 2.0;
-        vel[i].y += pull * (pheat[i] - pheat[n.n[j]]);
-        if ((pheat[i] - pheat[n.n[j]]) > 0) {
-          pos[n.n[j]].x += (pos[n.n[j]].x - pos[i].x) * .005;
-          pos[i].y +=
-              .008 * (pheat[i] - pheat[n.n[j]]) * (pheat[i] - pheat[n.n[j]]);
-          pos[n.n[j]].y += .0008 * (pheat[i] - pheat[n.n[j]]);
+    for (int ii = neighbors.Begin(i); ii < end; ii++) {
+      int j = neighbors.Neighbor(ii);
+      // Verlet lists also hold pairs up to h + skin apart
+      if (skin > 0 && glm::length(pos[i] - pos[j]) >= h) continue;
+      if (glm::length(ppos[i] - ppos[j]) <= 4.0 * r ||
+          (ppos[i].y < r && glm::length(ppos[i] - ppos[j]) < 10.0 * r)) {
+        heat[i] -= k * (pheat[i] - pheat[j]) / 2.0;
+        heat[j] += k * (pheat[i] - pheat[j]) / 2.0;
+        if (!asleep[i]) vel[i].y += pull * (pheat[i] - pheat[j]);
+        if ((pheat[i] - pheat[j]) > 0) {
+          if (!asleep[j]) {
+            pos[j].x += (pos[j].x - pos[i].x) * .005 * s;
+            pos[j].y += .0008 * s * (pheat[i] - pheat[j]);
+          }
+          if (!asleep[i]) {
+            pos[i].y +=
+                .008 * s * (pheat[i] - pheat[j]) * (pheat[i] - pheat[j]);
+          }
         }
-        if (ppos[i].y < ppos[n.n[j]].y) {
+        if (ppos[i].y < ppos[j].y) {
           aboveNeighbors += 1;
         }
       }
@@ -405,16 +907,17 @@ void SPHFluid::transferHeat() {
   return;
 }
 
-glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
-                                                 int i) {
+glm::vec3 SPHFluid::triangleSphereCollisionPoint(int t, int i) {
   // http://graphics.cs.aueb.gr/graphics/docs/papers/particle.pdf
 
   float inf = std::numeric_limits<float>::infinity();
 
-  glm::vec3 e1 = ss->pos[v1] - ss->pos[v2];
-  glm::vec3 e2 = ss->pos[v3] - ss->pos[v2];
-  glm::vec3 n = glm::normalize(glm::cross(e1, e2));
-  float d = -glm::dot(n, ss->pos[v2]);
+  const ClothTriangles &T = clothData;
+  int v1 = clothTris[3 * t];
+  int v2 = clothTris[3 * t + 1];
+  int v3 = clothTris[3 * t + 2];
+  glm::vec3 n(T.nx[t], T.ny[t], T.nz[t]);
+  float d = T.d[t];
 
   // Cylinder/triangle intersection
 
@@ -476,15 +979,13 @@ glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
   // triangle, there is a collision
   // http://blackpawn.com/texts/pointinpoly/
   glm::vec3 cProj = pos[i] - dist * n;
-  glm::vec3 a = ss->pos[v3] - ss->pos[v1];
-  glm::vec3 b = ss->pos[v2] - ss->pos[v1];
   glm::vec3 c = cProj - ss->pos[v1];
-  float dotaa = glm::dot(a, a);
-  float dotab = glm::dot(a, b);
-  float dotac = glm::dot(a, c);
-  float dotbb = glm::dot(b, b);
-  float dotbc = glm::dot(b, c);
-  float invDenom = 1 / (dotaa * dotbb - dotab * dotab);
+  float dotaa = T.dotaa[t];
+  float dotab = T.dotab[t];
+  float dotac = glm::dot(T.a[t], c);
+  float dotbb = T.dotbb[t];
+  float dotbc = glm::dot(T.b[t], c);
+  float invDenom = T.invDenom[t];
   float u = (dotbb * dotac - dotab * dotbc) * invDenom;
   float v = (dotaa * dotbc - dotab * dotac) * invDenom;
   if ((u >= 0) && (v >= 0) && (u + v < 1)) {
@@ -503,13 +1004,12 @@ glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
 
   // Step 4: Check if the sphere intersects with triangle edge
   glm::vec3 p1, p2, edge, q, qToC;
-  float t;
+  float s = (glm::dot(n, pos[i]) - T.nv1[t]) / T.nn[t];
 
   p1 = ss->pos[v1];
   p2 = ss->pos[v2];
   edge = p2 - p1;
-  t = (glm::dot(n, pos[i]) - glm::dot(n, ss->pos[v1])) / glm::dot(n, n);
-  q = p1 + t * edge;
+  q = p1 + s * edge;
   qToC = pos[i] - q;
   dist = glm::length(qToC);
   if (dist < r) {
@@ -527,8 +1027,7 @@ glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
   p1 = ss->pos[v2];
   p2 = ss->pos[v3];
   edge = p2 - p1;
-  t = (glm::dot(n, pos[i]) - glm::dot(n, ss->pos[v1])) / glm::dot(n, n);
-  q = p1 + t * edge;
+  q = p1 + s * edge;
   qToC = pos[i] - q;
   dist = glm::length(qToC);
   if (dist < r) {
@@ -545,8 +1044,7 @@ glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
   p1 = ss->pos[v3];
   p2 = ss->pos[v1];
   edge = p2 - p1;
-  t = (glm::dot(n, pos[i]) - glm::dot(n, ss->pos[v1])) / glm::dot(n, n);
-  q = p1 + t * edge;
+  q = p1 + s * edge;
   qToC = pos[i] - q;
   dist = glm::length(qToC);
   if (dist < r) {
@@ -563,151 +1061,303 @@ glm::vec3 SPHFluid::triangleSphereCollisionPoint(int v1, int v2, int v3,
   return glm::vec3(inf, inf, inf);
 }
 
+void SPHFluid::initClothTriangles() {
+  // Two triangles per cloth cell, in the order they used to be tested
+  clothTris.clear();
+  if (!ss) return;
+  for (int i = 0; i < ss->width; i++) {
+    for (int j = 0; j < ss->height; j++) {
+      int ij = i * (ss->height + 1) + j;
+
+      int tl = ij;                       // top left
+      int tr = ij + ss->height + 1;      // top right
+      int bl = ij + 1;                   // bottom left
+      int br = ij + ss->height + 1 + 1;  // bottom right
+
+      // Top triangle
+      clothTris.push_back(bl);
+      clothTris.push_back(tl);
+      clothTris.push_back(tr);
+
+      // Bottom triangle
+      clothTris.push_back(tr);
+      clothTris.push_back(br);
+      clothTris.push_back(bl);
+    }
+  }
+}
+
+void SPHFluid::updateClothTriangles() {
+  ClothTriangles &T = clothData;
+  int numTris = clothTris.size() / 3;
+  T.nx.resize(numTris);
+  T.ny.resize(numTris);
+  T.nz.resize(numTris);
+  T.d.resize(numTris);
+  T.nv1.resize(numTris);
+  T.nn.resize(numTris);
+  T.a.resize(numTris);
+  T.b.resize(numTris);
+  T.dotaa.resize(numTris);
+  T.dotab.resize(numTris);
+  T.dotbb.resize(numTris);
+  T.invDenom.resize(numTris);
+
+#pragma omp parallel for schedule(static)
+  for (int t = 0; t < numTris; t++) {
+    const glm::vec3 &v1 = ss->pos[clothTris[3 * t]];
+    const glm::vec3 &v2 = ss->pos[clothTris[3 * t + 1]];
+    const glm::vec3 &v3 = ss->pos[clothTris[3 * t + 2]];
+    glm::vec3 n = glm::normalize(glm::cross(v1 - v2, v3 - v2));
+    T.nx[t] = n.x;
+    T.ny[t] = n.y;
+    T.nz[t] = n.z;
+    T.d[t] = -glm::dot(n, v2);
+    T.nv1[t] = glm::dot(n, v1);
+    T.nn[t] = glm::dot(n, n);
+
+    glm::vec3 a = v3 - v1;
+    glm::vec3 b = v2 - v1;
+    T.a[t] = a;
+    T.b[t] = b;
+    T.dotaa[t] = glm::dot(a, a);
+    T.dotab[t] = glm::dot(a, b);
+    T.dotbb[t] = glm::dot(b, b);
+    T.invDenom[t] =
+        1 / (T.dotaa[t] * T.dotbb[t] - T.dotab[t] * T.dotab[t]);
+  }
+
+  clothGrid.build(ss->pos, clothTris.data(), numTris, r, gridRes);
+}
+
 void SPHFluid::clothInteraction() {
   if (!ss) return;
-  glm::vec3 e1, e2, n;
-  int tl, tr, bl, br;
+  float inf = std::numeric_limits<float>::infinity();
+  const ClothTriangles &T = clothData;
+  long tests = 0;
 
+  // Particles only move themselves, so they are independent
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : tests)
   for (int k = 0; k < numParticles; k++) {
-    float inf = std::numeric_limits<float>::infinity();
-    float minCollisionDist = inf;
-    // Iterate over triangles
-    for (int i = 0; i < ss->width; i++) {
-      for (int j = 0; j < ss->height; j++) {
-        int ij = i * (ss->height + 1) + j;
-
-        tl = ij;                       // top left
-        tr = ij + ss->height + 1;      // top right
-        bl = ij + 1;                   // bottom left
-        br = ij + ss->height + 1 + 1;  // bottom right
-
-        glm::vec3 q;
-        float dist;
-
-        // Top triangle
-        q = triangleSphereCollisionPoint(bl, tl, tr, k);
-        dist = glm::length(ppos[k] - q);
-        if (dist < minCollisionDist) {
-          minCollisionDist = dist;
-          pos[k] = q;
-#ifdef DEBUG
-          printf("Contact at %f %f %f\n", pos[k].x, pos[k].y, pos[k].z);
-#endif
-        }
+    // Only triangles whose grown box holds the particle can be hit
+    int c = clothGrid.cellId(pos[k]);
+    if (c < 0) continue;
+    int begin = clothGrid.cellStart(c), end = clothGrid.cellEnd(c);
+    tests += end - begin;
 
-        // Bottom triangle
-        q = triangleSphereCollisionPoint(tr, br, bl, k);
-        dist = glm::length(ppos[k] - q);
+    float minCollisionDist = inf;
+    for (int kk = begin; kk < end; kk += 8) {
+      // Most triangles are rejected by their plane, 8 at a time. The rest
+      // get the full test in order; a hit moves the particle, so the planes
+      // after it are tested again.
+      const int *tris = clothGrid.triangles(kk);
+      int n = std::min(8, end - kk);
+      unsigned hits = sphPlaneHits(pos[k], r, T.nx.data(), T.ny.data(),
+                                   T.nz.data(), T.d.data(), tris, n);
+      for (int l = 0; l < n; l++) {
+        if (!(hits >> l & 1)) continue;
+        glm::vec3 q = triangleSphereCollisionPoint(tris[l], k);
+        float dist = glm::length(ppos[k] - q);
         if (dist < minCollisionDist) {
           minCollisionDist = dist;
           pos[k] = q;
 #ifdef DEBUG
           printf("Contact at %f %f %f\n", pos[k].x, pos[k].y, pos[k].z);
 #endif
+          hits = sphPlaneHits(pos[k], r, T.nx.data(), T.ny.data(),
+                              T.nz.data(), T.d.data(), tris, n);
         }
       }
     }
   }
+  stats.clothTests += tests;
 }
 
-void SPHFluid::getNeighbors(int i, NeighborSet *n, bool pairwise) {
-  n->size = 0;
+void SPHFluid::reorderParticles() {
+  PhaseTimer t(&stats, PHASE_REORDER);
 
-#ifdef GRID
-  glm::ivec3 g = getGridPos(&pos[i]);
-  clampGridPos(&g);
-
-  // Iterate over surroung grid cells
-  for (int z = g.z - 1; z <= g.z + 1; z++) {
-    if (z < 0 || z > gridSize.z - 1) continue;
-    for (int y = g.y - 1; y <= g.y + 1; y++) {
-      if (y < 0 || y > gridSize.y - 1) continue;
-      for (int x = g.x - 1; x <= g.x + 1; x++) {
-        if (x < 0 || x > gridSize.x - 1) continue;
-
-        // Iterate over particles found in this grid cell
-        glm::ivec3 gridPos(x, y, z);
-        int cellId = getCellId(&gridPos);
-        int ii = cellStart[cellId];
-        if (ii < 0) {
-          continue;
-        }
-        for (; ii < numParticles && cellId == particleHash[ii].x; ii++) {
-          int j = particleHash[ii].y;
-          if ((pairwise && i > j) || i == j) continue;
-          if (glm::length(pos[i] - pos[j]) < h) {
-            n->n[n->size] = j;
-            n->size++;
-          }
-        }
-      }
-    }
+  // Sort indices by Morton code
+  std::vector<std::pair<unsigned, int> > keys(numParticles);
+  for (int i = 0; i < numParticles; i++) {
+    keys[i] = std::make_pair(grid.mortonCode(pos[i]), i);
   }
-#else
-  // Brute-force
-  for (int j = 0; j < numParticles; j++) {
-    if ((pairwise && i > j) || i == j) continue;
-    if (glm::length(pos[i] - pos[j]) < h) {
-      n->n[n->size] = j;
-      n->size++;
-    }
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<int> perm(numParticles), rank(numParticles);
+  for (int k = 0; k < numParticles; k++) {
+    perm[k] = keys[k].second;
+    rank[perm[k]] = k;
   }
-#endif
-}
+  particles.permute(perm.data(), numParticles);
 
-glm::ivec3 SPHFluid::getGridPos(glm::vec3 *p) {
-  glm::ivec3 gridPos;
-  gridPos.x = floor((p->x - worldOrigin.x) / h);
-  gridPos.y = floor((p->y - worldOrigin.y) / h);
-  gridPos.z = floor((p->z - worldOrigin.z) / h);
-  return gridPos;
-}
+  springs.renumber(rank.data());
 
-void SPHFluid::clampGridPos(glm::ivec3 *gridPos) {
-  gridPos->x = std::max(0, std::min(gridPos->x, gridSize.x - 1));
-  gridPos->y = std::max(0, std::min(gridPos->y, gridSize.y - 1));
-  gridPos->z = std::max(0, std::min(gridPos->z, gridSize.z - 1));
+  // Per-particle solver state that carries over between substeps
+  permuteVector(&asleep, perm);
+  permuteVector(&pressure, perm);
+  permuteVector(&pressureNear, perm);
+  permuteVector(&lastPressure, perm);
+  permuteVector(&lastHeat, perm);
+
+  // Lists and grid refer to the old indices
+  neighbors.invalidate();
+  grid.invalidate();
 }
 
-int SPHFluid::getCellId(glm::ivec3 *gridPos) {
-  clampGridPos(gridPos);
-  int cell = gridPos->z * gridSize.y * gridSize.x + gridPos->y * gridSize.x +
-             gridPos->x;
-  return cell;
+template <typename T>
+void SPHFluid::permuteVector(std::vector<T> *v, const std::vector<int> &perm) {
+  if (v->size() < perm.size()) return;
+  std::vector<T> old(v->begin(), v->begin() + perm.size());
+  for (size_t k = 0; k < perm.size(); k++) {
+    (*v)[k] = old[perm[k]];
+  }
 }
 
-void SPHFluid::findCellStart() {
+void SPHFluid::updateSleeping() {
+  int numCells = grid.NumCells();
+  cellQuiet.resize(numCells, 0);
+  cellBusy.assign(numCells, 0);
+  lastPressure.resize(numParticles, 0);
+  if (useHeat) lastHeat.resize(numParticles, 0);
+
+  // A cell stays awake while any particle in it or the cells around it moves
+  // or changes pressure, an awake particle has just entered it or the cloth
+  // is close to it. Particles interact across cell borders, so a quiet cell
+  // next to a busy one would freeze particles that are still being pushed.
+  // The tests are written so that NaNs count as busy.
   for (int i = 0; i < numParticles; i++) {
-    int cell = particleHash[i].x;
-    if (i > 0) {
-      if (cell != particleHash[i - 1].x) cellStart[cell] = i;
-    } else {
-      cellStart[cell] = i;
+    glm::ivec3 g = grid.gridPos(pos[i]);
+    int c = grid.cellId(g);
+    bool busy = !(glm::length(vel[i]) <= sleepSpeed);
+    if (!asleep[i]) {
+      busy = busy || cellQuiet[c] >= sleepSteps ||
+             !(std::abs(pressure[i] - lastPressure[i]) <= sleepPressure);
+      lastPressure[i] = pressure[i];
     }
+    // Sleeping particles still conduct heat, and wake once it moves them
+    if (useHeat) {
+      busy = busy || !(std::abs(heat[i] - lastHeat[i]) <= sleepHeat);
+      lastHeat[i] = heat[i];
+    }
+    if (ss) {
+      int tc = clothGrid.cellId(pos[i]);
+      busy = busy ||
+             (tc >= 0 && clothGrid.cellEnd(tc) > clothGrid.cellStart(tc));
+    }
+    if (!busy) continue;
+    for (int dz = -1; dz <= 1; dz++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          cellBusy[grid.cellId(g + glm::ivec3(dx, dy, dz))] = 1;
+        }
+      }
+    }
+  }
+
+  // Cells fall asleep after sleepSteps quiet substeps in a row
+  for (int c = 0; c < numCells; c++) {
+    cellQuiet[c] = cellBusy[c] ? 0 : std::min(cellQuiet[c] + 1, sleepSteps);
+  }
+  for (int i = 0; i < numParticles; i++) {
+    asleep[i] = cellQuiet[grid.cellId(pos[i])] >= sleepSteps;
+    stats.sleepingSteps += asleep[i];
   }
 }
 
-bool ivec2_ascending(glm::ivec2 i, glm::ivec2 j) { return i.x < j.x; }
+void SPHFluid::DomainBounds(glm::vec3 *lo, glm::vec3 *hi) {
+  glm::vec3 spawnLo, spawnHi;
+  initialParticleBounds(&spawnLo, &spawnHi);
+  *lo = glm::vec3(boxLeft - boxWallWidth, boxBottom, boxBack - boxWallWidth);
+  *hi = glm::vec3(boxRight + boxWallWidth, boxTop, boxFront + boxWallWidth);
+  *lo = glm::min(*lo, spawnLo);
+  *hi = glm::max(*hi, spawnHi);
+}
+
+void SPHFluid::initGrid() {
+  // Cell ids change, so every cell starts awake again
+  cellQuiet.clear();
+
+  if (hashedGrid) {
+    // About two buckets per particle, however far they spread out
+    grid.initHashed(gridRes, std::max(2 * maxParticles, 4096));
+    return;
+  }
+
+  // Cover the box and its walls as well as the region particles spawn in, so
+  // that neither gets squashed into the border cells
+  glm::vec3 lo, hi;
+  DomainBounds(&lo, &hi);
+
+  grid.init(lo, glm::ivec3(glm::ceil((hi - lo) / gridRes)), gridRes);
+}
 
 void SPHFluid::makeGrid() {
+  PhaseTimer t(&stats, PHASE_GRID);
+
 #ifdef GRID
-  delete[] particleHash;
-  delete[] cellStart;
-  particleHash = new glm::ivec2[numParticles];
-  cellStart = new int[maxCellId];
-  for (int i = 0; i < maxCellId; i++) {
-    cellStart[i] = -1;
+  // Keep the lists until a pair could have closed the skin. update() calls
+  // this before every phase that uses them, so the displacement includes the
+  // prediction step and springs. Without a skin the lists are kept only if
+  // nothing moved.
+  if (neighbors.NumParticles() == numParticles &&
+      maxDisplacement() <= skin / 2) {
+    neighborsFresh = false;
+    return;
   }
 
-  for (int i = 0; i < numParticles; i++) {
-    glm::ivec3 gridPos = getGridPos(&pos[i]);
-    int cellId = getCellId(&gridPos);
-    particleHash[i] = glm::ivec2(cellId, i);
+  if (grid.update(pos, numParticles, gridRebuildFraction)) {
+    stats.gridUpdates++;
+    stats.gridMoved += grid.NumMoved();
+  } else {
+    stats.gridBuilds++;
   }
+  neighbors.build(grid, pos, numParticles, h + skin);
+#else
+  neighbors.buildBruteForce(pos, numParticles, h);
+#endif
+  neighborsFresh = true;
+  stats.neighborBuilds++;
+}
+
+float SPHFluid::maxDisplacement() {
+  float maxMove2 = 0;
+  int n = std::min(numParticles, grid.NumParticles());
+  for (int i = 0; i < n; i++) {
+    glm::vec3 d = pos[i] - grid.SnapshotPosition(i);
+    maxMove2 = std::fmax(maxMove2, glm::dot(d, d));
+  }
+  return std::sqrt(maxMove2);
+}
 
-  std::sort(particleHash, particleHash + numParticles, ivec2_ascending);
+void SPHFluid::validateGrid(const char *phase) {
+#ifdef GRID
+  if (grid.NumParticles() != numParticles) {
+    printf("%s: grid has %d particles, fluid has %d\n", phase,
+           grid.NumParticles(), numParticles);
+  }
+
+  float maxMove = maxDisplacement();
 
-  findCellStart();
+  // Count pairs within h that the neighbor list no longer finds
+  int missed = 0, total = 0;
+  for (int i = 0; i < numParticles; i++) {
+    int found = 0, listed = 0;
+    for (int j = i + 1; j < numParticles; j++) {
+      if (glm::length(pos[i] - pos[j]) < h) found++;
+    }
+    if (i < neighbors.NumParticles()) {
+      for (int ii = neighbors.Begin(i); ii < neighbors.End(i); ii++) {
+        int j = neighbors.Neighbor(ii);
+        if (j > i && glm::length(pos[i] - pos[j]) < h) listed++;
+      }
+    }
+    total += found;
+    missed += found - listed;
+  }
+  if (missed > 0) {
+    printf("%s: stale grid missed %d of %d pairs, max move %f (h = %f)\n",
+           phase, missed, total, maxMove, h);
+  }
 #endif
 }
 
@@ -718,6 +1368,11 @@ glm::vec3 SPHFluid::initialParticlePosition(int i) {
   return glm::vec3(x, y, z);
 }
 
+void SPHFluid::initialParticleBounds(glm::vec3 *lo, glm::vec3 *hi) {
+  *lo = glm::vec3(1.2, 1.2, 0);
+  *hi = glm::vec3(1.4, 1.4, 0.1);
+}
+
 glm::vec3 SPHFluid::initialParticleVelocity(int i) {
   float x = -1.5 - 0.5 * rand01();
   float y = 2 + 1.5 * rand01();
@@ -856,7 +1511,33 @@ void SPHFluid::initVBO() {
   vboData[94] = boxBack - r;
 }
 
+void SPHFluid::SetCompactVBO(bool c) {
+  compactVbo = c;
+  if (!c) packedVbo = std::vector<PackedVertex>();
+  updateVBO();
+}
+
 void SPHFluid::updateVBO() {
+  PhaseTimer t(&stats, PHASE_VBO);
+  if (compactVbo) {
+    // Pack over the particles' own bounds, so ones that spill over the walls
+    // aren't clamped. NaNs fail the comparisons and are left out.
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (int i = 0; i < numParticles; i++) {
+      lo = glm::min(lo, pos[i]);
+      hi = glm::max(hi, pos[i]);
+    }
+    for (int d = 0; d < 3; d++) {
+      if (lo[d] > hi[d]) lo[d] = hi[d] = 0;
+    }
+    packedLo = lo;
+    packedHi = hi;
+    packedVbo.resize(numParticles);
+    sphPackVertices(pos, heat, numParticles, lo,
+                    65535.f / glm::max(hi - lo, glm::vec3(1e-6f)),
+                    packedVbo.data());
+    return;
+  }
   for (int i = 0; i < numParticles; i++) {
     vboData[4 * BOX_VERTICES + 4 * i + 0] = pos[i].x;
     vboData[4 * BOX_VERTICES + 4 * i + 1] = pos[i].y;
@@ -0,0 +1,410 @@
+#include "sph_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define HAVE_AVX2_KERNELS
+#define TARGET_AVX2
+#include <intrin.h>
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef void (*DensityKernel)(const glm::vec3 &, const glm::vec3 *,
+                              const int *, int, float, float *, float *,
+                              float *);
+typedef glm::vec3 (*DisplacementKernel)(const glm::vec3 &, float, float,
+                                        const glm::vec3 *, const float *,
+                                        const float *, const int *,
+                                        const float *, int, float, float);
+typedef void (*PairGeometryKernel)(const glm::vec3 *, const int *,
+                                   const int *, int, float *, glm::vec3 *);
+typedef unsigned (*PlaneHitsKernel)(const glm::vec3 &, float, const float *,
+                                    const float *, const float *,
+                                    const float *, const int *, int);
+typedef void (*PackVerticesKernel)(const glm::vec3 *, const float *, int,
+                                   const glm::vec3 &, const glm::vec3 &,
+                                   PackedVertex *);
+
+struct Kernels {
+  const char *name;
+  DensityKernel density;
+  DisplacementKernel displacement;
+  PairGeometryKernel pairGeometry;
+  PlaneHitsKernel planeHits;
+  PackVerticesKernel packVertices;
+};
+
+// Scalar kernels
+
+void densityScalar(const glm::vec3 &pi, const glm::vec3 *pos, const int *nbr,
+                   int n, float h, float *dist, float *p, float *pn) {
+  float invH = 1 / h;
+  float sp = 0, spn = 0;
+  for (int k = 0; k < n; k++) {
+    float d = glm::length(pi - pos[nbr[k]]);
+    dist[k] = d;
+    float q = d * invH;
+    if (q < 1) {
+      float w = 1 - q;
+      sp += w * w;
+      spn += w * w * w;
+    }
+  }
+  *p = sp;
+  *pn = spn;
+}
+
+glm::vec3 displacementScalar(const glm::vec3 &pi, float pres, float presn,
+                             const glm::vec3 *pos, const float *pressure,
+                             const float *pressureNear, const int *nbr,
+                             const float *dist, int n, float h, float dt) {
+  float invH = 1 / h;
+  glm::vec3 dx(0);
+  for (int k = 0; k < n; k++) {
+    int j = nbr[k];
+    float q = dist[k] * invH;
+    if (q < 1 && dist[k] > SPH_MIN_DIST) {
+      float w = 1 - q;
+      float D = dt * dt *
+                ((pres + pressure[j]) * w + (presn + pressureNear[j]) * w * w);
+      dx -= D / 2.f * (pos[j] - pi) / dist[k];
+    }
+  }
+  return dx;
+}
+
+void pairGeometryScalar(const glm::vec3 *pos, const int *i, const int *j,
+                        int n, float *dist, glm::vec3 *dir) {
+  for (int k = 0; k < n; k++) {
+    glm::vec3 d = pos[i[k]] - pos[j[k]];
+    float len = glm::length(d);
+    dist[k] = len;
+    dir[k] = len > SPH_MIN_DIST ? d / len : glm::vec3(0);
+  }
+}
+
+unsigned planeHitsScalar(const glm::vec3 &p, float r, const float *nx,
+                         const float *ny, const float *nz, const float *d,
+                         const int *tri, int n) {
+  unsigned hits = 0;
+  for (int k = 0; k < n; k++) {
+    int t = tri[k];
+    float dist = nx[t] * p.x + ny[t] * p.y + nz[t] * p.z + d[t];
+    if (!(std::fabs(dist) > r)) hits |= 1u << k;
+  }
+  return hits;
+}
+
+inline uint16_t quantize16(float v) {
+  return (uint16_t)(std::min(std::max(v, 0.f), 65535.f) + 0.5f);
+}
+
+void packVerticesScalar(const glm::vec3 *pos, const float *heat, int n,
+                        const glm::vec3 &lo, const glm::vec3 &scale,
+                        PackedVertex *out) {
+  for (int i = 0; i < n; i++) {
+    glm::vec3 q = (pos[i] - lo) * scale;
+    out[i].x = quantize16(q.x);
+    out[i].y = quantize16(q.y);
+    out[i].z = quantize16(q.z);
+    out[i].heat =
+        (uint8_t)(std::min(std::max(heat[i], 0.f), 1.f) * 255.f + 0.5f);
+    out[i].pad = 0;
+  }
+}
+
+const Kernels scalarKernels = {"scalar",           densityScalar,
+                               displacementScalar, pairGeometryScalar,
+                               planeHitsScalar,    packVerticesScalar};
+
+#ifdef HAVE_AVX2_KERNELS
+
+// AVX2 kernels. Each iteration handles 8 neighbors; lanes past n are masked
+// off so they neither load nor contribute.
+
+TARGET_AVX2 inline __m256i laneMask(int k, int n) {
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(n - k), lanes);
+}
+
+TARGET_AVX2 inline float horizontalSum(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+// Gather x, y and z of pos[idx] for the lanes in mask, 0 elsewhere
+TARGET_AVX2 inline void gatherPositions(const glm::vec3 *pos, __m256i idx,
+                                        __m256 mask, __m256 *x, __m256 *y,
+                                        __m256 *z) {
+  const float *base = &pos[0].x;
+  __m256i offset = _mm256_add_epi32(idx, _mm256_add_epi32(idx, idx));
+  __m256 zero = _mm256_setzero_ps();
+  *x = _mm256_mask_i32gather_ps(zero, base, offset, mask, 4);
+  *y = _mm256_mask_i32gather_ps(zero, base + 1, offset, mask, 4);
+  *z = _mm256_mask_i32gather_ps(zero, base + 2, offset, mask, 4);
+}
+
+TARGET_AVX2 void densityAvx2(const glm::vec3 &pi, const glm::vec3 *pos,
+                             const int *nbr, int n, float h, float *dist,
+                             float *p, float *pn) {
+  __m256 px = _mm256_set1_ps(pi.x);
+  __m256 py = _mm256_set1_ps(pi.y);
+  __m256 pz = _mm256_set1_ps(pi.z);
+  __m256 invH = _mm256_set1_ps(1 / h);
+  __m256 one = _mm256_set1_ps(1);
+  __m256 sp = _mm256_setzero_ps();
+  __m256 spn = _mm256_setzero_ps();
+  for (int k = 0; k < n; k += 8) {
+    __m256i mask = laneMask(k, n);
+    __m256 maskf = _mm256_castsi256_ps(mask);
+    __m256i idx = _mm256_maskload_epi32(nbr + k, mask);
+    __m256 x, y, z;
+    gatherPositions(pos, idx, maskf, &x, &y, &z);
+    __m256 dx = _mm256_sub_ps(px, x);
+    __m256 dy = _mm256_sub_ps(py, y);
+    __m256 dz = _mm256_sub_ps(pz, z);
+    __m256 d = _mm256_sqrt_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+        _mm256_mul_ps(dz, dz)));
+    _mm256_maskstore_ps(dist + k, mask, d);
+
+    __m256 q = _mm256_mul_ps(d, invH);
+    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(q, one, _CMP_LT_OQ), maskf);
+    __m256 w = _mm256_and_ps(_mm256_sub_ps(one, q), inside);
+    __m256 w2 = _mm256_mul_ps(w, w);
+    sp = _mm256_add_ps(sp, w2);
+    spn = _mm256_add_ps(spn, _mm256_mul_ps(w2, w));
+  }
+  *p = horizontalSum(sp);
+  *pn = horizontalSum(spn);
+}
+
+TARGET_AVX2 glm::vec3 displacementAvx2(const glm::vec3 &pi, float pres,
+                                       float presn, const glm::vec3 *pos,
+                                       const float *pressure,
+                                       const float *pressureNear,
+                                       const int *nbr, const float *dist,
+                                       int n, float h, float dt) {
+  __m256 px = _mm256_set1_ps(pi.x);
+  __m256 py = _mm256_set1_ps(pi.y);
+  __m256 pz = _mm256_set1_ps(pi.z);
+  __m256 invH = _mm256_set1_ps(1 / h);
+  __m256 one = _mm256_set1_ps(1);
+  __m256 halfDt2 = _mm256_set1_ps(-dt * dt / 2.f);
+  __m256 minDist = _mm256_set1_ps(SPH_MIN_DIST);
+  __m256 vpres = _mm256_set1_ps(pres);
+  __m256 vpresn = _mm256_set1_ps(presn);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 sx = zero, sy = zero, sz = zero;
+  for (int k = 0; k < n; k += 8) {
+    __m256i mask = laneMask(k, n);
+    __m256 maskf = _mm256_castsi256_ps(mask);
+    __m256i idx = _mm256_maskload_epi32(nbr + k, mask);
+    __m256 d = _mm256_maskload_ps(dist + k, mask);
+    __m256 q = _mm256_mul_ps(d, invH);
+    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(q, one, _CMP_LT_OQ), maskf);
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, minDist, _CMP_GT_OQ));
+    __m256 w = _mm256_sub_ps(one, q);
+
+    __m256 pj = _mm256_mask_i32gather_ps(zero, pressure, idx, inside, 4);
+    __m256 pnj = _mm256_mask_i32gather_ps(zero, pressureNear, idx, inside, 4);
+    __m256 D = _mm256_add_ps(
+        _mm256_mul_ps(_mm256_add_ps(vpres, pj), w),
+        _mm256_mul_ps(_mm256_add_ps(vpresn, pnj), _mm256_mul_ps(w, w)));
+    // -D / 2 / dist, zeroed outside h and for coincident particles so
+    // x / 0 in masked lanes drops out
+    __m256 c = _mm256_and_ps(
+        _mm256_div_ps(_mm256_mul_ps(halfDt2, D), d), inside);
+
+    __m256 x, y, z;
+    gatherPositions(pos, idx, inside, &x, &y, &z);
+    sx = _mm256_add_ps(sx, _mm256_mul_ps(c, _mm256_sub_ps(x, px)));
+    sy = _mm256_add_ps(sy, _mm256_mul_ps(c, _mm256_sub_ps(y, py)));
+    sz = _mm256_add_ps(sz, _mm256_mul_ps(c, _mm256_sub_ps(z, pz)));
+  }
+  return glm::vec3(horizontalSum(sx), horizontalSum(sy), horizontalSum(sz));
+}
+
+TARGET_AVX2 void pairGeometryAvx2(const glm::vec3 *pos, const int *i,
+                                  const int *j, int n, float *dist,
+                                  glm::vec3 *dir) {
+  float bx[8], by[8], bz[8];
+  for (int k = 0; k < n; k += 8) {
+    __m256i mask = laneMask(k, n);
+    __m256 maskf = _mm256_castsi256_ps(mask);
+    __m256 xi, yi, zi, xj, yj, zj;
+    gatherPositions(pos, _mm256_maskload_epi32(i + k, mask), maskf, &xi, &yi,
+                    &zi);
+    gatherPositions(pos, _mm256_maskload_epi32(j + k, mask), maskf, &xj, &yj,
+                    &zj);
+    __m256 dx = _mm256_sub_ps(xi, xj);
+    __m256 dy = _mm256_sub_ps(yi, yj);
+    __m256 dz = _mm256_sub_ps(zi, zj);
+    __m256 d = _mm256_sqrt_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+        _mm256_mul_ps(dz, dz)));
+    _mm256_maskstore_ps(dist + k, mask, d);
+    // Zero direction for coincident particles instead of 0 / 0
+    __m256 apart = _mm256_cmp_ps(d, _mm256_set1_ps(SPH_MIN_DIST), _CMP_GT_OQ);
+    _mm256_storeu_ps(bx, _mm256_and_ps(_mm256_div_ps(dx, d), apart));
+    _mm256_storeu_ps(by, _mm256_and_ps(_mm256_div_ps(dy, d), apart));
+    _mm256_storeu_ps(bz, _mm256_and_ps(_mm256_div_ps(dz, d), apart));
+    int m = std::min(8, n - k);
+    for (int l = 0; l < m; l++) {
+      dir[k + l] = glm::vec3(bx[l], by[l], bz[l]);
+    }
+  }
+}
+
+TARGET_AVX2 unsigned planeHitsAvx2(const glm::vec3 &p, float r,
+                                   const float *nx, const float *ny,
+                                   const float *nz, const float *d,
+                                   const int *tri, int n) {
+  __m256i mask = laneMask(0, n);
+  __m256 maskf = _mm256_castsi256_ps(mask);
+  __m256i idx = _mm256_maskload_epi32(tri, mask);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 x = _mm256_mask_i32gather_ps(zero, nx, idx, maskf, 4);
+  __m256 y = _mm256_mask_i32gather_ps(zero, ny, idx, maskf, 4);
+  __m256 z = _mm256_mask_i32gather_ps(zero, nz, idx, maskf, 4);
+  __m256 dist = _mm256_add_ps(
+      _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(p.x)),
+                        _mm256_mul_ps(y, _mm256_set1_ps(p.y))),
+          _mm256_mul_ps(z, _mm256_set1_ps(p.z))),
+      _mm256_mask_i32gather_ps(zero, d, idx, maskf, 4));
+  // Same test as the scalar !(|dist| > r), so NaN distances count as hits
+  __m256 absDist = _mm256_andnot_ps(_mm256_set1_ps(-0.f), dist);
+  __m256 hit = _mm256_cmp_ps(absDist, _mm256_set1_ps(r), _CMP_NGT_UQ);
+  return _mm256_movemask_ps(_mm256_and_ps(hit, maskf));
+}
+
+// round(clamp((v - lo) * scale, 0, top)), rounding as quantize16 does
+TARGET_AVX2 inline __m256i quantize(__m256 v, __m256 lo, __m256 scale,
+                                    __m256 top) {
+  __m256 q = _mm256_mul_ps(_mm256_sub_ps(v, lo), scale);
+  q = _mm256_min_ps(_mm256_max_ps(q, _mm256_setzero_ps()), top);
+  return _mm256_cvttps_epi32(_mm256_add_ps(q, _mm256_set1_ps(0.5f)));
+}
+
+// Packs 8 particles at a time and the rest with the scalar kernel, and
+// rounds the same way, so both give the same vertices
+TARGET_AVX2 void packVerticesAvx2(const glm::vec3 *pos, const float *heat,
+                                  int n, const glm::vec3 &lo,
+                                  const glm::vec3 &scale, PackedVertex *out) {
+  __m256 top16 = _mm256_set1_ps(65535.f);
+  __m256 top8 = _mm256_set1_ps(255.f);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 x, y, z;
+    gatherPositions(pos + k, idx, all, &x, &y, &z);
+    __m256i qx = quantize(x, _mm256_set1_ps(lo.x), _mm256_set1_ps(scale.x),
+                          top16);
+    __m256i qy = quantize(y, _mm256_set1_ps(lo.y), _mm256_set1_ps(scale.y),
+                          top16);
+    __m256i qz = quantize(z, _mm256_set1_ps(lo.z), _mm256_set1_ps(scale.z),
+                          top16);
+    __m256 h = _mm256_min_ps(_mm256_loadu_ps(heat + k), _mm256_set1_ps(1.f));
+    __m256i qh = quantize(h, zero, top8, top8);
+
+    // x | y << 16 and z | heat << 16 per particle, interleaved into vertices
+    __m256i a = _mm256_or_si256(qx, _mm256_slli_epi32(qy, 16));
+    __m256i b = _mm256_or_si256(qz, _mm256_slli_epi32(qh, 16));
+    __m256i v01 = _mm256_unpacklo_epi32(a, b);  // Vertices 0 1 | 4 5
+    __m256i v23 = _mm256_unpackhi_epi32(a, b);  // Vertices 2 3 | 6 7
+    _mm256_storeu_si256((__m256i *)(out + k),
+                        _mm256_permute2x128_si256(v01, v23, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + k + 4),
+                        _mm256_permute2x128_si256(v01, v23, 0x31));
+  }
+  packVerticesScalar(pos + k, heat + k, n - k, lo, scale, out + k);
+}
+
+const Kernels avx2Kernels = {"avx2",           densityAvx2,
+                             displacementAvx2, pairGeometryAvx2,
+                             planeHitsAvx2,    packVerticesAvx2};
+
+bool cpuHasAvx2() {
+#ifdef _MSC_VER
+  // AVX2 needs the CPU flag and the OS saving the upper halves of the ymm
+  // registers
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return false;
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif  // HAVE_AVX2_KERNELS
+
+const Kernels &bestKernels() {
+#ifdef HAVE_AVX2_KERNELS
+  if (cpuHasAvx2()) return avx2Kernels;
+#endif
+  return scalarKernels;
+}
+
+bool forceScalar = false;
+
+const Kernels &kernels() {
+  static const Kernels &best = bestKernels();
+  return forceScalar ? scalarKernels : best;
+}
+
+}  // namespace
+
+const char *sphKernelName() { return kernels().name; }
+
+void sphForceScalarKernels(bool force) { forceScalar = force; }
+
+void sphDensity(const glm::vec3 &pi, const glm::vec3 *pos, const int *nbr,
+                int n, float h, float *dist, float *p, float *pn) {
+  kernels().density(pi, pos, nbr, n, h, dist, p, pn);
+}
+
+glm::vec3 sphDisplacement(const glm::vec3 &pi, float pres, float presn,
+                          const glm::vec3 *pos, const float *pressure,
+                          const float *pressureNear, const int *nbr,
+                          const float *dist, int n, float h, float dt) {
+  return kernels().displacement(pi, pres, presn, pos, pressure, pressureNear,
+                                nbr, dist, n, h, dt);
+}
+
+void sphPairGeometry(const glm::vec3 *pos, const int *i, const int *j, int n,
+                     float *dist, glm::vec3 *dir) {
+  kernels().pairGeometry(pos, i, j, n, dist, dir);
+}
+
+unsigned sphPlaneHits(const glm::vec3 &p, float r, const float *nx,
+                      const float *ny, const float *nz, const float *d,
+                      const int *tri, int n) {
+  return kernels().planeHits(p, r, nx, ny, nz, d, tri, n);
+}
+
+void sphPackVertices(const glm::vec3 *pos, const float *heat, int n,
+                     const glm::vec3 &lo, const glm::vec3 &scale,
+                     PackedVertex *out) {
+  kernels().packVertices(pos, heat, n, lo, scale, out);
+}
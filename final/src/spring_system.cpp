@@ -299,6 +299,7 @@ void SpringSystem::updateNormals() {
   }
 }
 
+#ifndef HEADLESS
 void SpringSystem::moveBall(const Uint8* keyState) {
   if (keyState[SDL_SCANCODE_I]) {
     spherePos += sphereSpeed * glm::vec3(0, 0, 1);
@@ -313,3 +314,4 @@ void SpringSystem::moveBall(const Uint8* keyState) {
     spherePos += sphereSpeed * glm::vec3(1, 0, 0);
   }
 }
+#endif
@@ -0,0 +1,95 @@
+#include "spring_table.h"
+
+#include <algorithm>
+
+const SpringTable::Key SpringTable::EMPTY;
+
+SpringTable::SpringTable() { rehash(0); }
+
+SpringTable::Key SpringTable::pairKey(int a, int b) {
+  if (a > b) std::swap(a, b);
+  return (Key)(unsigned)a << 32 | (unsigned)b;
+}
+
+int SpringTable::slot(Key key) const {
+  // Fibonacci hashing, then linear probing
+  unsigned mask = keys.size() - 1;
+  unsigned s = (unsigned)((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+  while (keys[s] != key && keys[s] != EMPTY) {
+    s = (s + 1) & mask;
+  }
+  return s;
+}
+
+void SpringTable::rehash(int n) {
+  size_t capacity = 16;
+  while (capacity < 2 * (size_t)n) capacity *= 2;
+  keys.assign(capacity, EMPTY);
+  index.resize(capacity);
+  for (int t = 0; t < Size(); t++) {
+    Key key = pairKey(si[t], sj[t]);
+    int s = slot(key);
+    keys[s] = key;
+    index[s] = t;
+  }
+}
+
+int SpringTable::find(int a, int b) const {
+  int s = slot(pairKey(a, b));
+  return keys[s] == EMPTY ? -1 : index[s];
+}
+
+int SpringTable::insert(int a, int b, float L) {
+  Key key = pairKey(a, b);
+  int s = slot(key);
+  if (keys[s] != EMPTY) return index[s];
+
+  int t = Size();
+  si.push_back(std::min(a, b));
+  sj.push_back(std::max(a, b));
+  rest.push_back(L);
+  if (2 * (size_t)Size() > keys.size()) {
+    rehash(Size());
+  } else {
+    keys[s] = key;
+    index[s] = t;
+  }
+  return t;
+}
+
+void SpringTable::assign(const int *i, const int *j, const float *r, int n) {
+  si.resize(n);
+  sj.resize(n);
+  rest.assign(r, r + n);
+  for (int t = 0; t < n; t++) {
+    si[t] = std::min(i[t], j[t]);
+    sj[t] = std::max(i[t], j[t]);
+  }
+  rehash(n);
+}
+
+void SpringTable::removeLongerThan(float maxRest) {
+  int n = 0;
+  for (int t = 0; t < Size(); t++) {
+    if (rest[t] > maxRest) continue;
+    si[n] = si[t];
+    sj[n] = sj[t];
+    rest[n] = rest[t];
+    n++;
+  }
+  if (n == Size()) return;
+  si.resize(n);
+  sj.resize(n);
+  rest.resize(n);
+  rehash(n);
+}
+
+void SpringTable::renumber(const int *rank) {
+  for (int t = 0; t < Size(); t++) {
+    int i = rank[si[t]];
+    int j = rank[sj[t]];
+    si[t] = std::min(i, j);
+    sj[t] = std::max(i, j);
+  }
+  rehash(Size());
+}
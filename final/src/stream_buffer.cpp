@@ -0,0 +1,76 @@
+#include "stream_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+StreamBuffer::StreamBuffer(int regions)
+    : buffer(0),
+      regionBytes(0),
+      stride(1),
+      mapped(nullptr),
+      fences(std::max(2, regions), nullptr),
+      region(-1) {}
+
+void StreamBuffer::init(GLuint b, size_t bytes, size_t vertexBytes) {
+  buffer = b;
+  stride = vertexBytes;
+  // Regions start on whole vertices so draws can be offset to them
+  regionBytes = std::max((bytes + stride - 1) / stride, (size_t)1) * stride;
+  size_t total = regionBytes * fences.size();
+
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  if (GLAD_GL_ARB_buffer_storage) {
+    GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, total, nullptr, flags);
+    mapped = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags);
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, total, nullptr, GL_STREAM_DRAW);
+  }
+}
+
+int StreamBuffer::write(const void *data, size_t bytes) {
+  region = (region + 1) % (int)fences.size();
+  wait(region);
+
+  bytes = std::min(bytes, regionBytes);
+  size_t offset = regionBytes * region;
+  if (mapped) {
+    std::memcpy(mapped + offset, data, bytes);
+  } else {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, data);
+  }
+  return (int)(offset / stride);
+}
+
+void StreamBuffer::fence() {
+  if (region < 0) return;
+  // A region drawn again without a new write keeps only its latest fence
+  if (fences[region]) glDeleteSync(fences[region]);
+  fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void StreamBuffer::wait(int k) {
+  if (!fences[k]) return;
+  GLenum status = GL_TIMEOUT_EXPIRED;
+  while (status == GL_TIMEOUT_EXPIRED) {
+    status = glClientWaitSync(fences[k], GL_SYNC_FLUSH_COMMANDS_BIT,
+                              1000000000);
+  }
+  glDeleteSync(fences[k]);
+  fences[k] = nullptr;
+}
+
+void StreamBuffer::close() {
+  for (size_t k = 0; k < fences.size(); k++) {
+    if (fences[k]) glDeleteSync(fences[k]);
+    fences[k] = nullptr;
+  }
+  if (mapped) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    mapped = nullptr;
+  }
+  region = -1;
+}
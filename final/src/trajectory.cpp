@@ -0,0 +1,488 @@
+#include "trajectory.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#include "sph_fluid.h"
+#include "spring_system.h"
+
+namespace {
+
+const char MAGIC[8] = "SPHTRAJ";
+const char END_MAGIC[8] = "SPHTEND";
+
+int seek(FILE *f, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(f, (long long)offset, SEEK_SET);
+#else
+  return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+uint64_t fileSize(FILE *f) {
+#ifdef _WIN32
+  _fseeki64(f, 0, SEEK_END);
+  return (uint64_t)_ftelli64(f);
+#else
+  fseeko(f, 0, SEEK_END);
+  return (uint64_t)ftello(f);
+#endif
+}
+
+template <typename T>
+void append(std::vector<uint8_t> *out, const T *data, size_t n) {
+  const uint8_t *p = (const uint8_t *)data;
+  out->insert(out->end(), p, p + n * sizeof(T));
+}
+
+// Difference of two quantized coordinates as a zigzag varint, 1 to 3 bytes
+void putDelta(std::vector<uint8_t> *out, uint16_t q, uint16_t prev) {
+  int16_t d = (int16_t)(uint16_t)(q - prev);
+  unsigned z = (uint16_t)(((unsigned)d << 1) ^ (unsigned)(d >> 15));
+  while (z >= 0x80) {
+    out->push_back((uint8_t)(z | 0x80));
+    z >>= 7;
+  }
+  out->push_back((uint8_t)z);
+}
+
+// Inverse of putDelta, false if the varint runs past end
+bool getDelta(const uint8_t **p, const uint8_t *end, uint16_t prev,
+              uint16_t *q) {
+  unsigned z = 0;
+  for (int shift = 0; shift < 21; shift += 7) {
+    if (*p == end) return false;
+    uint8_t b = *(*p)++;
+    z |= (unsigned)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      int16_t d = (int16_t)((z >> 1) ^ (0u - (z & 1)));
+      *q = (uint16_t)(prev + d);
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+const uint32_t TrajectoryWriter::VERSION;
+
+TrajectoryWriter::TrajectoryWriter(int ringSize, int chunkFrames)
+    : chunkFrames(std::max(chunkFrames, 1)),
+      file(nullptr),
+      ring(std::max(ringSize, 1)),
+      head(0),
+      tail(0),
+      queued(0),
+      closing(false),
+      chunkFirst(0),
+      chunkCount(0),
+      offset(0),
+      frames(0),
+      dropped(0),
+      bytes(0) {}
+
+TrajectoryWriter::~TrajectoryWriter() { close(); }
+
+bool TrajectoryWriter::open(const char *path) {
+  close();
+  file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Can't write trajectory %s\n", path);
+    return false;
+  }
+
+  TrajectoryHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.chunkFrames = chunkFrames;
+  fwrite(&header, sizeof(header), 1, file);
+
+  head = tail = queued = 0;
+  closing = false;
+  prevParticles.clear();
+  prevCloth.clear();
+  chunk.clear();
+  chunkFirst = chunkCount = 0;
+  pending.resize(chunkFrames);
+  offset = sizeof(header);
+  bytes = 0;
+  index.clear();
+  frames = dropped = 0;
+  writer = std::thread(&TrajectoryWriter::run, this);
+  return true;
+}
+
+bool TrajectoryWriter::record(float time, SPHFluid *fluid, SpringSystem *ss) {
+  if (!file) return false;
+  int k;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queued == (int)ring.size()) {
+      dropped++;
+      return false;
+    }
+    k = tail;
+  }
+
+  // Slot k isn't queued yet, so the writer thread leaves it alone
+  Slot &s = ring[k];
+  int n = fluid->NumParticles();
+  int m = ss ? ss->NumNodes() : 0;
+  s.time = time;
+  s.numParticles = n;
+  s.numCloth = m;
+  s.pos.resize(n + m);
+  s.vel.resize(n);
+  s.heat.resize(n);
+  for (int id = 0; id < n; id++) {
+    int i = fluid->ParticleIndex(id);
+    s.pos[id] = fluid->Position(i);
+    s.vel[id] = fluid->Velocity(i);
+    s.heat[id] = fluid->Heat(i);
+  }
+  for (int i = 0; i < m; i++) s.pos[n + i] = ss->Position(i);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tail = (tail + 1) % ring.size();
+    queued++;
+    frames++;
+  }
+  ready.notify_one();
+  return true;
+}
+
+void TrajectoryWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    ready.wait(lock, [this] { return queued > 0 || closing; });
+    if (queued == 0) break;
+    int k = head;
+    lock.unlock();
+    // Keep the frame until its chunk is full, giving the ring slot the
+    // buffers of a frame already written
+    pending[chunkCount].pos.swap(ring[k].pos);
+    pending[chunkCount].vel.swap(ring[k].vel);
+    pending[chunkCount].heat.swap(ring[k].heat);
+    pending[chunkCount].time = ring[k].time;
+    pending[chunkCount].numParticles = ring[k].numParticles;
+    pending[chunkCount].numCloth = ring[k].numCloth;
+    if (++chunkCount == (uint32_t)chunkFrames) flushChunk();
+    lock.lock();
+    head = (head + 1) % ring.size();
+    queued--;
+  }
+}
+
+void TrajectoryWriter::encode(const Slot &s, const glm::vec3 &lo,
+                              const glm::vec3 &scale) {
+  int n = s.numParticles, m = s.numCloth;
+
+  // The first frame of a chunk is coded against zeros, and particles that
+  // are new since the last frame against zero too
+  prevParticles.resize(3 * n, 0);
+  prevCloth.resize(3 * m, 0);
+
+  TrajectoryFrame f;
+  f.time = s.time;
+  f.numParticles = n;
+  f.numCloth = m;
+  f.velScale = 0;
+  f.heatMin = n ? s.heat[0] : 0;
+  f.heatMax = f.heatMin;
+  for (int i = 0; i < n; i++) {
+    glm::vec3 v = glm::abs(s.vel[i]);
+    f.velScale = std::max(f.velScale, std::max(v.x, std::max(v.y, v.z)));
+    f.heatMin = std::min(f.heatMin, s.heat[i]);
+    f.heatMax = std::max(f.heatMax, s.heat[i]);
+  }
+
+  // Everything lies within the chunk bounds, the clamp only catches
+  // rounding and non-finite positions
+  q.resize(3 * (n + m));
+  for (int i = 0; i < n + m; i++) {
+    glm::vec3 t = glm::clamp((s.pos[i] - lo) * scale, 0.f, 65535.f);
+    q[3 * i + 0] = (uint16_t)(t.x + 0.5f);
+    q[3 * i + 1] = (uint16_t)(t.y + 0.5f);
+    q[3 * i + 2] = (uint16_t)(t.z + 0.5f);
+  }
+
+  frame.clear();
+  for (int c = 0; c < 3 * n; c++) {
+    putDelta(&frame, q[c], prevParticles[c]);
+    prevParticles[c] = q[c];
+  }
+  for (int c = 0; c < 3 * m; c++) {
+    putDelta(&frame, q[3 * n + c], prevCloth[c]);
+    prevCloth[c] = q[3 * n + c];
+  }
+
+  float toVel = f.velScale > 0 ? 32767 / f.velScale : 0;
+  std::vector<int16_t> vel(3 * n);
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      vel[3 * i + c] = (int16_t)std::lround(s.vel[i][c] * toVel);
+    }
+  }
+  append(&frame, vel.data(), vel.size());
+  float range = f.heatMax - f.heatMin;
+  float toHeat = range > 0 ? 65535 / range : 0;
+  std::vector<uint16_t> heat(n);
+  for (int i = 0; i < n; i++) {
+    heat[i] = (uint16_t)std::lround((s.heat[i] - f.heatMin) * toHeat);
+  }
+  append(&frame, heat.data(), heat.size());
+
+  f.bytes = (uint32_t)frame.size();
+  append(&chunk, &f, 1);
+  chunk.insert(chunk.end(), frame.begin(), frame.end());
+}
+
+void TrajectoryWriter::flushChunk() {
+  if (chunkCount == 0) return;
+
+  // Quantize over the extent of every position in the chunk, NaNs fail
+  // the comparisons and are left out
+  glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+  for (uint32_t k = 0; k < chunkCount; k++) {
+    const std::vector<glm::vec3> &pos = pending[k].pos;
+    for (size_t i = 0; i < pos.size(); i++) {
+      lo = glm::min(lo, pos[i]);
+      hi = glm::max(hi, pos[i]);
+    }
+  }
+  for (int d = 0; d < 3; d++) {
+    if (lo[d] > hi[d]) lo[d] = hi[d] = 0;
+  }
+  glm::vec3 scale = 65535.f / glm::max(hi - lo, glm::vec3(1e-6f));
+
+  // The first frame of the chunk is a keyframe
+  prevParticles.clear();
+  prevCloth.clear();
+  chunk.clear();
+  for (uint32_t k = 0; k < chunkCount; k++) encode(pending[k], lo, scale);
+
+  TrajectoryChunk c;
+  c.firstFrame = chunkFirst;
+  c.numFrames = chunkCount;
+  c.bytes = chunk.size();
+  for (int d = 0; d < 3; d++) {
+    c.lo[d] = lo[d];
+    c.hi[d] = hi[d];
+  }
+  TrajectoryIndexEntry e;
+  e.offset = offset;
+  e.firstFrame = chunkFirst;
+  e.numFrames = chunkCount;
+  index.push_back(e);
+
+  fwrite(&c, sizeof(c), 1, file);
+  fwrite(chunk.data(), 1, chunk.size(), file);
+  offset += sizeof(c) + chunk.size();
+
+  chunkFirst += chunkCount;
+  chunkCount = 0;
+}
+
+void TrajectoryWriter::close() {
+  if (!file) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+  }
+  ready.notify_one();
+  writer.join();
+  flushChunk();
+
+  TrajectoryFooter footer;
+  footer.indexOffset = offset;
+  footer.numChunks = index.size();
+  std::memcpy(footer.magic, END_MAGIC, sizeof(END_MAGIC));
+  if (!index.empty()) {
+    fwrite(index.data(), sizeof(index[0]), index.size(), file);
+  }
+  fwrite(&footer, sizeof(footer), 1, file);
+  bytes = offset + index.size() * sizeof(index[0]) + sizeof(footer);
+  if (ferror(file)) fprintf(stderr, "Error writing trajectory\n");
+  fclose(file);
+  file = nullptr;
+}
+
+TrajectoryReader::TrajectoryReader()
+    : file(nullptr), size(0), numFrames(0), chunkId(-1), at(0), next(-1) {}
+
+TrajectoryReader::~TrajectoryReader() { close(); }
+
+bool TrajectoryReader::open(const char *path) {
+  close();
+  file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Can't open trajectory %s\n", path);
+    return false;
+  }
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != TrajectoryWriter::VERSION) {
+    fprintf(stderr, "%s is not a trajectory\n", path);
+    close();
+    return false;
+  }
+
+  // Use the index if the writer was closed, otherwise walk the chunks
+  size = fileSize(file);
+  TrajectoryFooter footer;
+  bool indexed = size >= sizeof(header) + sizeof(footer) &&
+                 seek(file, size - sizeof(footer)) == 0 &&
+                 fread(&footer, sizeof(footer), 1, file) == 1 &&
+                 std::memcmp(footer.magic, END_MAGIC, sizeof(END_MAGIC)) == 0;
+  // The index has to fit between the header and the footer
+  uint64_t indexEnd = size - sizeof(footer);
+  indexed = indexed && footer.indexOffset >= sizeof(header) &&
+            footer.indexOffset <= indexEnd &&
+            footer.numChunks <= (indexEnd - footer.indexOffset) /
+                                    sizeof(TrajectoryIndexEntry);
+  if (indexed) {
+    index.resize(footer.numChunks);
+    indexed = seek(file, footer.indexOffset) == 0 &&
+              fread(index.data(), sizeof(index[0]), index.size(), file) ==
+                  index.size();
+  }
+  if (!indexed) {
+    index.clear();
+    uint64_t offset = sizeof(header);
+    TrajectoryChunk c;
+    while (offset + sizeof(c) <= size && seek(file, offset) == 0 &&
+           fread(&c, sizeof(c), 1, file) == 1 &&
+           c.bytes <= size - offset - sizeof(c)) {
+      TrajectoryIndexEntry e = {offset, c.firstFrame, c.numFrames};
+      index.push_back(e);
+      offset += sizeof(c) + c.bytes;
+    }
+  }
+  numFrames = 0;
+  for (size_t c = 0; c < index.size(); c++) {
+    numFrames += index[c].numFrames;
+  }
+  return true;
+}
+
+void TrajectoryReader::close() {
+  if (file) fclose(file);
+  file = nullptr;
+  size = 0;
+  index.clear();
+  numFrames = 0;
+  chunkId = -1;
+  next = -1;
+}
+
+bool TrajectoryReader::loadChunk(int c) {
+  TrajectoryChunk h;
+  chunkId = -1;
+  next = -1;
+  uint64_t offset = index[c].offset;
+  if (offset > size || size - offset < sizeof(h) || seek(file, offset) != 0 ||
+      fread(&h, sizeof(h), 1, file) != 1 ||
+      h.bytes > size - offset - sizeof(h)) {
+    return false;
+  }
+  chunk.resize(h.bytes);
+  if (fread(chunk.data(), 1, chunk.size(), file) != chunk.size()) {
+    return false;
+  }
+  chunkId = c;
+  chunkLo = glm::vec3(h.lo[0], h.lo[1], h.lo[2]);
+  chunkStep = (glm::vec3(h.hi[0], h.hi[1], h.hi[2]) - chunkLo) / 65535.f;
+  at = 0;
+  next = h.firstFrame;
+  prevParticles.clear();
+  prevCloth.clear();
+  return true;
+}
+
+bool TrajectoryReader::decodeNext(TrajectoryState *out) {
+  TrajectoryFrame f;
+  if (chunk.size() - at < sizeof(f)) return false;
+  std::memcpy(&f, chunk.data() + at, sizeof(f));
+  at += sizeof(f);
+  if (chunk.size() - at < f.bytes) return false;
+  const uint8_t *p = chunk.data() + at;
+  const uint8_t *end = p + f.bytes;
+  at += f.bytes;
+  next++;
+
+  int n = f.numParticles, m = f.numCloth;
+  prevParticles.resize(3 * n, 0);
+  prevCloth.resize(3 * m, 0);
+  for (int c = 0; c < 3 * n; c++) {
+    if (!getDelta(&p, end, prevParticles[c], &prevParticles[c])) return false;
+  }
+  for (int c = 0; c < 3 * m; c++) {
+    if (!getDelta(&p, end, prevCloth[c], &prevCloth[c])) return false;
+  }
+  if ((size_t)(end - p) != 3 * n * sizeof(int16_t) + n * sizeof(uint16_t)) {
+    return false;
+  }
+
+  // Frames before the requested one only have to update the positions
+  if (!out) return true;
+  glm::vec3 lo = chunkLo, step = chunkStep;
+  out->time = f.time;
+  out->pos.resize(n);
+  out->vel.resize(n);
+  out->heat.resize(n);
+  out->cloth.resize(m);
+  for (int i = 0; i < n; i++) {
+    const uint16_t *q = &prevParticles[3 * i];
+    out->pos[i] = lo + glm::vec3(q[0], q[1], q[2]) * step;
+  }
+  for (int i = 0; i < m; i++) {
+    const uint16_t *q = &prevCloth[3 * i];
+    out->cloth[i] = lo + glm::vec3(q[0], q[1], q[2]) * step;
+  }
+  std::vector<int16_t> vel(3 * n);
+  std::vector<uint16_t> heat(n);
+  if (n) {
+    std::memcpy(vel.data(), p, vel.size() * sizeof(vel[0]));
+    std::memcpy(heat.data(), p + vel.size() * sizeof(vel[0]),
+                heat.size() * sizeof(heat[0]));
+  }
+  float fromVel = f.velScale / 32767;
+  float fromHeat = (f.heatMax - f.heatMin) / 65535;
+  for (int i = 0; i < n; i++) {
+    out->vel[i] =
+        glm::vec3(vel[3 * i], vel[3 * i + 1], vel[3 * i + 2]) * fromVel;
+    out->heat[i] = f.heatMin + heat[i] * fromHeat;
+  }
+  return true;
+}
+
+bool TrajectoryReader::readFrame(int k, TrajectoryState *out) {
+  if (!file || k < 0 || k >= numFrames) return false;
+
+  // Last chunk starting at or before frame k
+  int lo = 0, hi = (int)index.size() - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if ((int)index[mid].firstFrame <= k) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  // Keep decoding the current chunk if frame k is still ahead
+  if (lo != chunkId || next < 0 || next > k) {
+    if (!loadChunk(lo)) return false;
+  }
+  bool ok = true;
+  while (ok && next < k) ok = decodeNext(nullptr);
+  ok = ok && decodeNext(out);
+
+  // Start the chunk over next time rather than trust a partial decode
+  if (!ok) chunkId = -1;
+  return ok;
+}
@@ -0,0 +1,94 @@
+#include "triangle_grid.h"
+
+#include <algorithm>
+#include <limits>
+
+TriangleGrid::TriangleGrid()
+    : origin(0, 0, 0), size(0, 0, 0), invCellSize(1), numCells(0) {
+  start.assign(1, 0);
+}
+
+glm::ivec3 TriangleGrid::gridPos(const glm::vec3 &p) const {
+  return glm::clamp(glm::ivec3(glm::floor((p - origin) * invCellSize)),
+                    glm::ivec3(0), size - 1);
+}
+
+int TriangleGrid::cellId(const glm::vec3 &p) const {
+  glm::ivec3 g = glm::ivec3(glm::floor((p - origin) * invCellSize));
+  if (glm::any(glm::lessThan(g, glm::ivec3(0))) ||
+      glm::any(glm::greaterThanEqual(g, size))) {
+    return -1;
+  }
+  return (g.z * size.y + g.y) * size.x + g.x;
+}
+
+void TriangleGrid::build(const glm::vec3 *v, const int *tri, int n, float r,
+                         float cellSize) {
+  float inf = std::numeric_limits<float>::infinity();
+  boxLo.resize(n);
+  boxHi.resize(n);
+  glm::vec3 lo(inf), hi(-inf);
+  for (int t = 0; t < n; t++) {
+    const glm::vec3 &a = v[tri[3 * t]];
+    const glm::vec3 &b = v[tri[3 * t + 1]];
+    const glm::vec3 &c = v[tri[3 * t + 2]];
+    // A sphere can hit an edge from up to r * (1 + edge length) away from
+    // its first vertex, and everything else from within r of the triangle
+    float edge = std::max(glm::length(a - b),
+                          std::max(glm::length(b - c), glm::length(c - a)));
+    float margin = r * (1 + edge);
+    boxLo[t] = glm::min(a, glm::min(b, c)) - margin;
+    boxHi[t] = glm::max(a, glm::max(b, c)) + margin;
+    lo = glm::min(lo, boxLo[t]);
+    hi = glm::max(hi, boxHi[t]);
+  }
+
+  if (n == 0) {
+    size = glm::ivec3(0);
+    numCells = 0;
+    start.assign(1, 0);
+    return;
+  }
+
+  // Coarsen the cells if the triangles are spread out, so the grid stays
+  // about as large as the triangle count
+  origin = lo;
+  long maxCells = 4L * n + 64;
+  for (;;) {
+    invCellSize = 1 / cellSize;
+    size = glm::max(glm::ivec3(glm::ceil((hi - lo) * invCellSize)), 1);
+    if ((long)size.x * size.y * size.z <= maxCells) break;
+    cellSize *= 2;
+  }
+  numCells = size.x * size.y * size.z;
+
+  // Count triangles per cell
+  start.assign(numCells + 1, 0);
+  for (int t = 0; t < n; t++) {
+    glm::ivec3 l = gridPos(boxLo[t]), h = gridPos(boxHi[t]);
+    for (int z = l.z; z <= h.z; z++) {
+      for (int y = l.y; y <= h.y; y++) {
+        for (int x = l.x; x <= h.x; x++) {
+          start[(z * size.y + y) * size.x + x + 1]++;
+        }
+      }
+    }
+  }
+  for (int c = 0; c < numCells; c++) {
+    start[c + 1] += start[c];
+  }
+
+  // Scatter in triangle order, so each cell lists its triangles in order
+  fill.assign(start.begin(), start.end() - 1);
+  sorted.resize(start[numCells]);
+  for (int t = 0; t < n; t++) {
+    glm::ivec3 l = gridPos(boxLo[t]), h = gridPos(boxHi[t]);
+    for (int z = l.z; z <= h.z; z++) {
+      for (int y = l.y; y <= h.y; y++) {
+        for (int x = l.x; x <= h.x; x++) {
+          sorted[fill[(z * size.y + y) * size.x + x]++] = t;
+        }
+      }
+    }
+  }
+}